@@ -1,6 +1,11 @@
 /* -----------------------------------------------------------------------------------------------------------
  * IOT device based on ATMEGA 328P + SIM800L + DHT11
  * will send temperature and humidity reading over SMS message in response to SMS
+ * SMS commands : INT <minutes> - periodic report to the sender ( 0 - off ), TH <x.y> - report only when
+ * temperature changed by at least x.y since last report, MODE SLEEP / MODE AWAKE - SIM800L sleep policy,
+ * STATUS - settings and network diagnostics, every command is answered with STATUS and kept in EEPROM
+ * TLIM <low> <high> / HLIM <low> <high> - temperature / humidity alarm bounds ( TLIM 0 - off ), sensor is checked
+ * every 5 minutes without waking SIM800L up and the sender gets SMS when alarm is raised or cleared
  *
  * by Adam Loboda - adam.loboda@wp.pl
  *
@@ -24,20 +29,23 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
 #include <util/delay.h>
 #include <avr/sleep.h>
 #include <avr/wdt.h>
 #include <string.h>
 #include <avr/power.h>
+#include <util/atomic.h>
 
 #define UART_NO_DATA 0x0100
-// internal RC oscillator 8MHz with divison by 8 and U2X0 = 1, gives 0.2% error rate for 9600 bps UART speed
-// and lower current consumption
-// for 1MHz : -U lfuse:w:0x62:m     on ATMEGA328P
-#define F_CPU 1000000UL
+// internal RC oscillator 8MHz is divided by 8 after reset ( -U lfuse:w:0x62:m on ATMEGA328P ), main() switches
+// the division off - bit 0 of DHT frame lasts only ~ 76us and its capture interrupt must not be late behind
+// UART and tick interrupts, at 1MHz it would have ~ 76 cycles for that. MCU sleeps in POWER DOWN most of
+// the time so the higher clock costs little. U2X0 = 1 gives 0.2% error rate for 9600 bps UART speed
+#define F_CPU 8000000UL
 
 #define BAUD 9600
-// formula for 1MHz clock and U2X0 = 1 double UART speed 
+// formula for U2X0 = 1 double UART speed 
 #define MYUBBR ((F_CPU / (BAUD * 8L)) - 1)
 
 
@@ -48,34 +56,146 @@
 
 #define DHT_ERR_OK         (0)
 #define DHT_ERR_TIMEOUT    (-1)
+#define DHT_ERR_CHECKSUM   (-2)
 
 #define DHT_PIN_INPUT()    (DDRB &= ~_BV(DHT_PIN))
 #define DHT_PIN_OUTPUT()   (DDRB |= _BV(DHT_PIN))
 #define DHT_PIN_LOW()      (PORTB &= ~_BV(DHT_PIN))
 #define DHT_PIN_HIGH()     (PORTB |= _BV(DHT_PIN))
 #define DHT_PIN_READ()     (PINB & _BV(DHT_PIN))
-#define DHT_TIMEOUT        (80)
+#define DHT_EDGES          (42)    // falling edges in frame - response, then 40 bits
+#define DHT_BIT_THRESHOLD  (100)   // us between falling edges, bit 0 takes ~ 76us, bit 1 ~ 120us
+#define DHT_START_PULSE    (20000) // us of LOW start pulse, ended by Timer1 compare match
+#define DHT_JOB_TIMEOUT    (30UL)  // ms for start pulse and whole frame, frame takes ~ 5ms
+#define DHT_BUSY           (1)     // reading still in progress
+#define DHT_MIN_INTERVAL   (2000UL) // ms sensor needs between readings ( and after power up )
+#define DHT_FRESH_TIME     (60000UL) // ms last good reading is served from cache instead of reading the sensor
+
+// Timer1 counts microseconds for DHT input capture - prescaler 1 for 1MHz clock, 8 for 8MHz clock
+#if F_CPU > 2000000UL
+#define DHT_T1_PRESCALER   (1<<CS11)
+#else
+#define DHT_T1_PRESCALER   (1<<CS10)
+#endif
+
+// Timer0 generates 1 ms system tick - prescaler 8 for 1MHz clock, 64 for 8MHz clock
+#if F_CPU > 2000000UL
+#define TICK_PRESCALER     ((1<<CS01)|(1<<CS00))
+#define TICK_OCR           ((F_CPU / 64 / 1000) - 1)
+#else
+#define TICK_PRESCALER     (1<<CS01)
+#define TICK_OCR           ((F_CPU / 8 / 1000) - 1)
+#endif
+
+// WDT prescaler bits for 8 s and 1 s periods ( 1024K and 128K cycles of 128kHz oscillator )
+#define WDT_8S             ((1<<WDP3)|(1<<WDP0))
+#define WDT_1S             ((1<<WDP2)|(1<<WDP1))
+#define WDT_CALIBRATION_INTERVAL  (3600000UL)   // measure WDT oscillator again after 1 hour
+
+// network registration backoff - search time with radio on, then no search with radio off for a time growing
+// twice from REG_BACKOFF_MIN to REG_BACKOFF_MAX ( milliseconds ) plus random jitter of up to 1/4 of the time
+#define REG_SEARCH_TIME    (60000UL)
+#define REG_BACKOFF_MIN    (60000UL)
+#define REG_BACKOFF_MAX    (3600000UL)
+
+// cached registration state from +CREG: reports, AT+CREG? is sent only when nothing was heard for
+// REG_QUERY_TIME while waiting, cache older than REG_CACHE_TIME is not trusted
+#define REG_UNKNOWN        (0xFF)
+#define REG_QUERY_TIME     (20000UL)
+#define REG_CACHE_TIME     (1800000UL)
+
+// readline_timeout() results
+#define READLINE_TIMEOUT   (0)
+#define READLINE_OK        (1)
+
+// AT command engine results and timeouts ( milliseconds ) 
+#define AT_OK              (0)
+#define AT_ERROR           (1)
+#define AT_TIMEOUT         (2)
+
+// line tokens recognised by streaming parser, numbers must match order of AT_TOKENS table
+#define TOK_NONE           (0)
+#define TOK_OK             (1)
+#define TOK_ERROR          (2)
+#define TOK_CME_ERROR      (3)
+#define TOK_CMS_ERROR      (4)
+#define TOK_CREG           (5)
+#define TOK_CPIN           (6)
+#define TOK_CMT            (7)
+#define TOK_SAPBR          (8)
+#define TOK_HTTPACTION     (9)
+#define TOK_CSQ            (10)
+#define TOK_CCLK           (11)
+#define TOK_CMGS           (12)
+#define TOK_RING           (13)
+#define TOK_CLIP           (14)
+#define TOK_CMGL           (15)
+#define AT_TOKENS_COUNT    (15)
+
+#define AT_TIMEOUT_PROBE   (1000UL)     // AT when modem may be still asleep
+#define AT_TIMEOUT_CMD     (5000UL)     // ordinary configuration command
+#define AT_TIMEOUT_CFUN    (10000UL)    // switching radio on/off
+#define AT_TIMEOUT_CPIN    (5000UL)     // +CPIN: report of SIM card after start or after entering PIN
+#define AT_TIMEOUT_CMGDA   (25000UL)    // deleting all stored SMS
+#define AT_TIMEOUT_CMGS    (60000UL)    // sending SMS over the network
+#define RI_LINE_TIMEOUT    (5000UL)     // waiting for message from SIM800L after RI wakeup
+#define RX_DRAIN_TIMEOUT   (500UL)      // rest of a line already started when RX ring is drained
+#define CHECKAT_ATTEMPTS   (30)         // AT probes before SIM800L is taken as dead
+#define CHECKPIN_ATTEMPTS  (10)         // AT+CPIN? polls before SIM card is taken as missing or locked
+#define MODEM_FAULT_SLEEP  (3600000UL)  // SIM800L is not used this long after it failed one of the checks
+
+// RI pulse classes - SIM800L pulls RI LOW for 120 ms for SMS and URC ( AT+CFGRI=1 ),
+// for incoming voice call until the call is answered or ended, shorter LOW is a glitch
+#define RI_NOISE           (0)
+#define RI_PULSE           (1)
+#define RI_CALL            (2)
+#define RI_REPORT          (3)          // not RI at all - periodic report, alarm SMS or queued query is due
+#define RI_PULSE_MIN       (50)         // milliseconds
+#define RI_CALL_TIME       (1000UL)
 
 // static text needed for SIM800L conversation
 
 const char AT[] PROGMEM = { "AT\n\r" }; // wakeup from sleep mode
 const char ISOK[] PROGMEM = { "OK" };
-const char ISREG1[] PROGMEM = { "+CREG: 0,1" };  // registered in HPLMN
-const char ISREG2[] PROGMEM = { "+CREG: 0,5" };  // registered in ROAMING NETWORK
+const char ISERROR[] PROGMEM = { "ERROR" };
+const char ISCMEERROR[] PROGMEM = { "+CME ERROR" };
+const char ISCMSERROR[] PROGMEM = { "+CMS ERROR" };
+const char ISCREG[] PROGMEM = { "+CREG:" };
+const char ISCPIN[] PROGMEM = { "+CPIN:" };
+const char ISCMT[] PROGMEM = { "+CMT:" };                  // mobile terminated SMS
+const char ISSAPBR[] PROGMEM = { "+SAPBR:" };              // IP bearer status
+const char ISHTTPACTION[] PROGMEM = { "+HTTPACTION:" };    // result of HTTP request from the server
+const char ISCSQ[] PROGMEM = { "+CSQ:" };                  // signal quality
+const char ISCCLK[] PROGMEM = { "+CCLK:" };                // network clock
+const char ISCMGS[] PROGMEM = { "+CMGS:" };                // SMS was sent
+const char ISRING[] PROGMEM = { "RING" };                  // incoming voice call
+const char ISCLIP[] PROGMEM = { "+CLIP:" };                // number of the caller after RING
+const char ISCMGL[] PROGMEM = { "+CMGL:" };                // SMS stored in SIM
+
+// token table for streaming parser of SIM800L responses
+const char * const AT_TOKENS[AT_TOKENS_COUNT] PROGMEM = { ISOK, ISERROR, ISCMEERROR, ISCMSERROR, ISCREG, ISCPIN, ISCMT,
+                                                         ISSAPBR, ISHTTPACTION, ISCSQ, ISCCLK, ISCMGS, ISRING, ISCLIP, ISCMGL };
 const char SHOW_REGISTRATION[] PROGMEM = {"AT+CREG?\n\r"};
-const char PIN_IS_READY[] PROGMEM = {"+CPIN: READY"};
-const char PIN_MUST_BE_ENTERED[] PROGMEM = {"+CPIN: SIM PIN"};
+const char REGISTRATION_REPORT[] PROGMEM = { "AT+CREG=2\r\n" };   // +CREG: <stat>,<lac>,<ci> on every change
+const char PIN_IS_READY[] PROGMEM = {"READY"};              // +CPIN: READY
+const char PIN_MUST_BE_ENTERED[] PROGMEM = {"SIM PIN"};      // +CPIN: SIM PIN
 
 const char SHOW_PIN[] PROGMEM = {"AT+CPIN?\n\r"};
+const char SHOW_CSQ[] PROGMEM = {"AT+CSQ\r\n"};               // +CSQ: <rssi>,<ber>
+const char SHOW_CLOCK[] PROGMEM = {"AT+CCLK?\r\n"};           // +CCLK: "yy/MM/dd,hh:mm:ss+zz"
 const char ECHO_OFF[] PROGMEM = {"ATE0\n\r"};
 const char ENTER_PIN[] PROGMEM = {"AT+CPIN=\"1111\"\n\r"};
 const char CFGRIPIN[] PROGMEM = {"AT+CFGRI=1\n\r"};
 const char HANGUP[] PROGMEM = {"ATH\n\r"};
+const char SHOWCALLER[] PROGMEM = {"AT+CLIP=1\r\n"};           // +CLIP: "<number>",<type>,... after RING
 const char SMS1[] PROGMEM = {"AT+CMGF=1\r\n"};
 const char SMS2[] PROGMEM = {"AT+CMGS=\""};                    // for other networks if they show +XX in CLIP
-const char DELSMS[] PROGMEM = {"AT+CMGDA=\"DEL ALL\"\r\n"};    // delete all stored SMS just in case
+const char DELSMS[] PROGMEM = {"AT+CMGDA=\"DEL READ\"\r\n"};   // delete read SMS, unread ones are queries not answered yet
+const char DELONESMS[] PROGMEM = {"AT+CMGD="};                 // delete stored SMS by index
+const char LISTSMS[] PROGMEM = {"AT+CMGL=\"REC UNREAD\",1\r\n"};  // SMS stored in SIM and not read yet, status is kept
 const char SHOWSMS[] PROGMEM = {"AT+CNMI=1,2,0,0,0\r\n"};      // display automatically SMS when arrives
-const char ISSMS[] PROGMEM = {"CMT:"};                         // beginning of mobile terminated SMS identification
+const char STORESMS[] PROGMEM = {"AT+CNMI=1,1,0,0,0\r\n"};     // store SMS in SIM while replying, only +CMTI: is shown
+const char ENDCMD[] PROGMEM = {"\r\n"};
 
 const char CRLF[] PROGMEM = {"\"\n\r"};
 
@@ -97,316 +217,1327 @@ const char SAVECNF[] PROGMEM = { "AT&W\r\n" };
 const char TEMPERATURESMS[] PROGMEM = {" Temperature : "};
 const char HUMIDITYSMS[] PROGMEM = {" Humidity : "};
 
+// SMS commands and STATUS reply
+const char CMD_INT[] PROGMEM = {"INT"};
+const char CMD_TH[] PROGMEM = {"TH"};
+const char CMD_MODE[] PROGMEM = {"MODE"};
+const char CMD_STATUS[] PROGMEM = {"STATUS"};
+const char MODE_SLEEP_TXT[] PROGMEM = {"SLEEP"};
+const char MODE_AWAKE_TXT[] PROGMEM = {"AWAKE"};
+const char STATUSSMS1[] PROGMEM = {" INT:"};
+const char STATUSSMS2[] PROGMEM = {" TH:"};
+const char STATUSSMS3[] PROGMEM = {" MODE:"};
+const char STATUSSMS4[] PROGMEM = {" CSQ:"};
+const char STATUSSMS5[] PROGMEM = {" LAC:"};
+const char STATUSSMS6[] PROGMEM = {" CI:"};
+const char STATUSSMS7[] PROGMEM = {" NOREG:"};
+const char STATUSSMS8[] PROGMEM = {" TLIM:"};
+const char STATUSSMS9[] PROGMEM = {" HLIM:"};
+const char CMD_TLIM[] PROGMEM = {"TLIM"};
+const char CMD_HLIM[] PROGMEM = {"HLIM"};
+const char ALARMSMS1[] PROGMEM = {" ALARM T:"};
+const char ALARMSMS2[] PROGMEM = {" H:"};
+const char ALARM_OK_TXT[] PROGMEM = {"OK"};
+const char ALARM_LOW_TXT[] PROGMEM = {"LOW"};
+const char ALARM_HIGH_TXT[] PROGMEM = {"HIGH"};
+const char ALARM_OFF_TXT[] PROGMEM = {"OFF"};
+const char * const ALARM_STATES[3] PROGMEM = { ALARM_OK_TXT, ALARM_LOW_TXT, ALARM_HIGH_TXT };
+
 
 #define BUFFER_SIZE 40
 // buffers for number of phone, responses from modem
 volatile static uint8_t response[BUFFER_SIZE] = "1234567890123456789012345678901234567890";
 volatile static uint8_t response_pos = 0;
 volatile static uint8_t dhttxt[6] = "00000\x00";
-volatile static uint8_t phonenumber[15] = "123456789012345";
-volatile static uint8_t phonenumber_pos = 0;
-volatile static uint8_t buf[20];  // buffer to copy string from PROGMEM
+
+// DHT frame received by Timer1 input capture interrupt
+volatile static uint8_t dht_times[DHT_EDGES];   // low byte of ICR1 at every falling edge
+volatile static uint8_t dht_edges = 0;
+static uint8_t dht_data[5];
+static uint32_t dht_started = 0;
+static int8_t dht_result = DHT_ERR_TIMEOUT;
+
+// last good DHT frame ( without checksum ) and system tick when its reading was started
+static uint8_t dht_cache[4];
+static uint32_t dht_cache_time = 0;
+static uint8_t dht_cache_valid = 0;
+static uint8_t phonenumber[16] = "123456789012345";
+
+// numbers of SMS senders and callers waiting for reply, every number is queued only once
+// with kind of reply - periodic report, reading, alarm and reading, settings with alarm and reading
+// ( higher kind includes everything of lower one )
+#define QUERY_QUEUE_SIZE   (4)
+#define QUERY_REPORT       (0)
+#define QUERY_READING      (1)
+#define QUERY_ALARM        (2)
+#define QUERY_STATUS       (3)
+static uint8_t query_numbers[QUERY_QUEUE_SIZE][16];
+static uint8_t query_kind[QUERY_QUEUE_SIZE];
+static uint8_t query_count = 0;
+static uint8_t query_last = 0;         // entry of the last queued or found number
+static uint8_t sms_body = 0;           // next line is text of SMS, SMS_BODY_xxx
+
+// SMS command waiting in the queue with its sender, it is applied from main loop right before the reply ( not in the
+// middle of AT command where the text was read ), the last command of a sender wins
+#define SMS_ARG_SIZE       (16)
+static uint8_t query_command[QUERY_QUEUE_SIZE];        // 1 + index in SMS_COMMANDS, 0 - no command
+static char query_arg[QUERY_QUEUE_SIZE][SMS_ARG_SIZE];
+
+// line after +CMT: / +CMGL: header is text of SMS ( may be empty ) - of the sender in query_last or of SMS whose
+// sender was not queued ( full queue, hidden number ), it is never taken for a result code
+#define SMS_BODY_NONE      (0)
+#define SMS_BODY_QUERY     (1)
+#define SMS_BODY_SKIP      (2)
+
+// SMS stored in SIM listed by AT+CMGL - indexes of those to delete after the reply, SMS whose sender did not fit
+// into the queue stays unread in SIM for next listing, at most SMS_LIST_PASSES listings between two sleeps so SMS
+// which can not be deleted is not answered over and over
+#define SMS_LIST_PASSES    (4)
+static uint8_t sms_stored[QUERY_QUEUE_SIZE];
+static uint8_t sms_stored_count = 0;
+static uint8_t sms_passes = 0;
+
+// settings changed by SMS commands and kept in EEPROM, erased EEPROM or other version gives defaults
+#define CFG_VERSION        (3)
+#define MODE_SLEEP         (0)          // SIM800L in SLEEP MODE ( AT+CSCLK=2 ) between queries
+#define MODE_AWAKE         (1)          // SIM800L stays awake, more current but no wakeup delay
+#define INTERVAL_MAX       (10080)      // minutes, one week keeps system tick arithmetic safe
+struct config {
+  uint8_t version;
+  uint16_t interval;                   // minutes between periodic reports, 0 - no reports
+  uint16_t threshold;                  // 10 times temperature change needed for periodic report, 0 - always
+  uint8_t mode;
+  uint8_t owner[16];                   // number which sent the first command, only it may change settings,
+                                       // so one number gets both periodic reports and alarms
+  int16_t low[2];                      // 10 times alarm bounds of temperature and humidity ( may be below zero ),
+  int16_t high[2];                     // high bound not above low one - no alarm for the channel
+};
+static struct config cfg;
+struct config EEMEM cfg_eeprom;
+static uint32_t next_report = 0;
+static uint16_t report_temperature = 0;
+static uint8_t report_sent = 0;
+static uint8_t numtxt[11];
+
+// alarm engine - state of every channel is changed after ALARM_DEBOUNCE samples in a row which want it,
+// raised alarm is cleared only inside the bounds narrowed by ALARM_HYSTERESIS so reading near the bound does not flap
+#define ALARM_TEMPERATURE  (0)          // channels
+#define ALARM_HUMIDITY     (1)
+#define ALARM_CHANNELS     (2)
+#define ALARM_NONE         (0)          // channel states
+#define ALARM_LOW          (1)
+#define ALARM_HIGH         (2)
+#define ALARM_DEBOUNCE     (2)
+#define ALARM_HYSTERESIS   (10)         // 1.0 degree / %RH
+#define ALARM_SAMPLE_INTERVAL  (5UL * 60UL * 1000UL)
+static uint8_t alarm_state[ALARM_CHANNELS];
+static uint8_t alarm_count[ALARM_CHANNELS];
+static uint32_t next_check = 0;
+
+// streaming parser state - tokens still matching current line, recognised token and its arguments offset
+static uint16_t tok_match = 0;
+static uint8_t line_token = TOK_NONE;
+static uint8_t line_arg = 0;
+
+// arguments of recognised line split into comma separated fields - offset and length in 'response'
+// quotes around a field are not part of it, commas inside quotes do not split
+#define AT_MAX_FIELDS      (8)
+#define FLD_NEW            (0)   // next char begins a field
+#define FLD_PLAIN          (1)   // inside unquoted field
+#define FLD_QUOTED         (2)   // inside quoted field
+#define FLD_CLOSED         (3)   // after closing quote, waiting for comma
+#define FLD_FULL           (4)   // no room for more fields
+static uint8_t field_off[AT_MAX_FIELDS];
+static uint8_t field_len[AT_MAX_FIELDS];
+static uint8_t field_count = 0;
+static uint8_t field_state = FLD_NEW;
+
+// UART receive ring buffer filled by USART RX interrupt, size must be power of two
+// rx_head is written only by the ISR, rx_tail only by the main code - no locking needed
+#define RX_RING_SIZE 64
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+volatile static uint8_t rx_ring[RX_RING_SIZE];
+volatile static uint8_t rx_head = 0;
+volatile static uint8_t rx_tail = 0;
+
+// UART transmit queue drained by USART data register empty interrupt
+// each entry is a pointer to PROGMEM string or a single char ( tx_pgm = NULL ), texts are not copied to RAM
+// tx_head is written only by the main code, tx_tail only by the ISR
+#define TX_QUEUE_SIZE 16
+#define TX_QUEUE_MASK (TX_QUEUE_SIZE - 1)
+static const char * volatile tx_pgm[TX_QUEUE_SIZE];
+volatile static uint8_t tx_char[TX_QUEUE_SIZE];
+volatile static uint8_t tx_head = 0;
+volatile static uint8_t tx_tail = 0;
+volatile static uint8_t tx_sent = 0;   // set when some char was written to UDR0 since last flush
+
+// milliseconds since power on, incremented by Timer0 compare interrupt
+volatile static uint32_t ticks_ms = 0;
+
+// watchdog sleep service - measured length of 8 s WDT period and milliseconds added by WDT interrupt
+volatile static uint16_t wdt_period_ms = 0;
+volatile static uint16_t wdt_add_ms = 0;
+volatile static uint8_t wdt_fired = 0;
+volatile static uint8_t ri_woken = 0;        // set by INT0 interrupt from RI pin of SIM800L
+static uint8_t ri_line = TOK_NONE;           // +CMT: / RING / +CLIP: line read while RI was LOW
+static uint32_t wdt_calibrated_at = 0;
+
+// registration diagnostics - unsuccessful searches in a row and seconds spent in the last ( or ongoing ) search
+static uint16_t reg_attempts = 0;
+static uint32_t reg_elapsed = 0;
+static uint16_t rnd_state = 1;
+
+// registration backoff kept between sessions - next search not before 'reg_retry' while 'reg_waiting' is set
+static uint32_t reg_delay = REG_BACKOFF_MIN;
+static uint32_t reg_retry = 0;
+static uint8_t reg_waiting = 0;
+
+// registration state, location area code and cell id, time of last +CREG: line
+static uint8_t reg_stat = REG_UNKNOWN;
+static uint16_t reg_lac = 0;
+static uint16_t reg_ci = 0;
+static uint32_t reg_updated = 0;
+
+
+
+// ----------------------------------------------------------------------------------------------
+// init_uart
+// ----------------------------------------------------------------------------------------------
+void init_uart(void) {
+  // double speed by U2X0 flag = 1 to have 0.2% error rate on 9600 baud
+ UCSR0A = (1<<U2X0);
+  // set baud rate from PRESCALER
+ UBRR0H = (uint8_t)(MYUBBR>>8);
+ UBRR0L = (uint8_t)(MYUBBR);
+ UCSR0B|=(1<<TXEN0); //enable TX
+ UCSR0B|=(1<<RXEN0); //enable RX
+ UCSR0B|=(1<<RXCIE0); //enable RX complete interrupt feeding rx_ring
+  // set frame format for SIM808 communication
+ UCSR0C|=(1<<UCSZ00)|(1<<UCSZ01); // no parity, 1 stop bit, 8-bit data 
+ sei();
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// USART data register empty interrupt - send next char from TX queue
+// PROGMEM strings are streamed directly from flash, interrupt is disabled when queue is empty
+// ----------------------------------------------------------------------------------------------
+ISR(USART_UDRE_vect)
+{
+  const char *p;
+  uint8_t c;
+
+  if (tx_head == tx_tail)
+     { UCSR0B &= ~(1<<UDRIE0);
+       return;
+     };
+
+  p = tx_pgm[tx_tail];
+  if (p == NULL)
+     { // single char entry
+       c = tx_char[tx_tail];
+       tx_tail = (tx_tail + 1) & TX_QUEUE_MASK;
+     }
+  else
+     { // PROGMEM string entry, go to next entry after its last char
+       c = pgm_read_byte(p++);
+       if (pgm_read_byte(p) == 0x00) tx_tail = (tx_tail + 1) & TX_QUEUE_MASK;
+                                else tx_pgm[tx_tail] = p;
+     };
+
+  // clear TX complete flag, it will be set again when this char leaves shift register
+  UCSR0A = (1<<U2X0) | (1<<TXC0);
+  UDR0 = c;
+  tx_sent = 1;
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// uart_wait_tx
+// Puts MCU into IDLE sleep until next interrupt while TX interrupt is still active
+// ----------------------------------------------------------------------------------------------
+void uart_wait_tx(void) {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  if (UCSR0B & (1<<UDRIE0))
+     { sleep_enable();
+       sei();
+       sleep_cpu();
+       sleep_disable();
+     };
+  sei();
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// tx_enqueue
+// Puts PROGMEM string pointer ( or single char if p = NULL ) into TX queue and starts transmission
+// if queue is full MCU sleeps until UDRE interrupt makes some room
+// ----------------------------------------------------------------------------------------------
+void tx_enqueue(const char *p, uint8_t c) {
+  uint8_t next;
+
+  next = (tx_head + 1) & TX_QUEUE_MASK;
+  while (next == tx_tail) uart_wait_tx();
+
+  tx_pgm[tx_head] = p;
+  tx_char[tx_head] = c;
+  tx_head = next;
+
+  // enable UDRE interrupt - it fires immediately if data register is empty
+  UCSR0B |= (1<<UDRIE0);
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// uart_flush_tx
+// Waits until TX queue is empty and last char has left the shift register, MCU idles meanwhile
+// needed before MCU goes to POWER DOWN sleep because USART is stopped then
+// ----------------------------------------------------------------------------------------------
+void uart_flush_tx(void) {
+  while (UCSR0B & (1<<UDRIE0)) uart_wait_tx();
+  if (tx_sent)
+     { loop_until_bit_is_set(UCSR0A, TXC0);
+       tx_sent = 0;
+     };
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// send_uart
+// Sends a single char to UART over TX queue
+// ----------------------------------------------------------------------------------------------
+void send_uart(uint8_t c) {
+  tx_enqueue(NULL, c);
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// USART RX complete interrupt - put received char into ring buffer
+// when the ring is full the new char is dropped, unread data is never overwritten
+// ----------------------------------------------------------------------------------------------
+ISR(USART_RX_vect)
+{
+  uint8_t c, next;
+
+  c = UDR0;
+  next = (rx_head + 1) & RX_RING_MASK;
+  if (next != rx_tail)
+     { rx_ring[rx_head] = c;
+       rx_head = next;
+     };
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// uart_getc
+// Takes a single char from RX ring buffer, returns UART_NO_DATA if ring is empty
+// ----------------------------------------------------------------------------------------------
+uint16_t uart_getc(void) {
+  uint8_t c;
+
+  if (rx_head == rx_tail) return UART_NO_DATA;
+  c = rx_ring[rx_tail];
+  rx_tail = (rx_tail + 1) & RX_RING_MASK;
+  return c;
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// uart_wait_rx
+// Puts MCU into IDLE sleep until next interrupt if RX ring buffer is empty
+// interrupts are enabled just before SLEEP instruction so no char can be missed
+// ----------------------------------------------------------------------------------------------
+void uart_wait_rx(void) {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  if (rx_head == rx_tail)
+     { sleep_enable();
+       sei();
+       sleep_cpu();
+       sleep_disable();
+     };
+  sei();
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// receive_uart
+// Receives a single char from RX ring buffer, MCU is sleeping while waiting for it
+// ----------------------------------------------------------------------------------------------
+uint8_t receive_uart() {
+  uint16_t c;
+
+  while ( (c = uart_getc()) == UART_NO_DATA ) 
+    uart_wait_rx(); 
+  return (uint8_t)c; 
+}
+
+
+// ----------------------------------------------------------------------------------------------
+// uart_puts
+// Sends a string, chars are copied into TX queue so buffer can be reused right after the call
+// ----------------------------------------------------------------------------------------------
+void uart_puts(const char *s) {
+  while (*s) {
+    send_uart(*s);
+    s++;
+  }
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// uart_puts_P
+// Sends a PROGMEM string, only the pointer is queued - string is streamed from flash by ISR
+// ----------------------------------------------------------------------------------------------
+void uart_puts_P(const char *s) {
+  if (pgm_read_byte(s) != 0x00) tx_enqueue(s, 0);
+}
+
+
+// ----------------------------------------------------------------------------------------------
+// init_tick
+// Timer0 in CTC mode generates interrupt every 1 ms
+// ----------------------------------------------------------------------------------------------
+void init_tick(void) {
+  TCCR0A = (1<<WGM01);          // CTC mode, TOP = OCR0A
+  OCR0A = TICK_OCR;
+  TCCR0B = TICK_PRESCALER;
+  TIMSK0 |= (1<<OCIE0A);        // compare match A interrupt
+  sei();
+}
+
+
+ISR(TIMER0_COMPA_vect)
+{
+  ticks_ms++;
+}
+
+
+// ----------------------------------------------------------------------------------------------
+// millis
+// Returns milliseconds since power on, 32 bit value is read with interrupts disabled
+// ----------------------------------------------------------------------------------------------
+uint32_t millis(void) {
+  uint32_t t;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+    t = ticks_ms;
+    };
+  return t;
+}
+
+
+
+// *********************************************************************************************************
+// streaming parser of SIM800L lines - fed by readline_timeout() char by char as they arrive
+// every token from AT_TOKENS table still matching the beginning of the line is kept as a bit in tok_match
+// and compared directly with flash, so the line is classified when its last char arrives
+// line_token = TOK_xxx of recognised line, line_arg = offset in 'response' where arguments begin
+// *********************************************************************************************************
+void parse_begin(void)
+{
+  tok_match = (1UL << AT_TOKENS_COUNT) - 1;
+  line_token = TOK_NONE;
+  line_arg = 0;
+  field_count = 0;
+  field_state = FLD_NEW;
+}
+
+
+// splits arguments into fields as chars arrive, only offsets and lengths are stored
+void field_char(uint8_t c, uint8_t pos)
+{
+  if (field_state == FLD_NEW)
+     { if (field_count >= AT_MAX_FIELDS)
+          { field_state = FLD_FULL;
+            return;
+          };
+       field_len[field_count] = 0;
+       field_count++;
+       if (c == '"')
+          { field_off[field_count-1] = pos + 1;
+            field_state = FLD_QUOTED;
+            return;
+          };
+       field_off[field_count-1] = pos;
+       field_state = FLD_PLAIN;
+     };
+
+  switch (field_state)
+     {
+       case FLD_PLAIN:  if (c == ',')  field_state = FLD_NEW;
+                        else  field_len[field_count-1]++;
+                        break;
+       case FLD_QUOTED: if (c == '"')  field_state = FLD_CLOSED;
+                        else  field_len[field_count-1]++;
+                        break;
+       case FLD_CLOSED: if (c == ',')  field_state = FLD_NEW;
+                        break;
+     };
+}
+
+
+void parse_char(uint8_t c, uint8_t pos)
+{
+  uint8_t t;
+  uint16_t bit;
+  char tc;
+
+  for (t = 0, bit = 1; (tok_match != 0) && (t < AT_TOKENS_COUNT); t++, bit <<= 1)
+    {
+      if ( !(tok_match & bit) ) continue;
+      tc = pgm_read_byte( (const char *)pgm_read_word(&AT_TOKENS[t]) + pos );
+      if (tc == 0x00)
+         { // whole token matched - arguments begin here ( after a space if there is one ), final result codes
+           // OK / ERROR must be the whole line ( parse_end ) so text only starting with them is not taken for one
+           tok_match &= ~bit;
+           if ( (t + 1) <= TOK_ERROR )  continue;
+           line_token = t + 1;
+           line_arg = (c == ' ') ? (pos + 1) : pos;
+           field_count = 0;
+           field_state = FLD_NEW;
+         }
+      else if (tc != c)  tok_match &= ~bit;
+    };
+
+  if ( (line_token != TOK_NONE) && (pos >= line_arg) )  field_char(c, pos);
+}
+
+
+void parse_end(uint8_t len)
+{
+  uint8_t t;
+  uint16_t bit;
+
+  // tokens forming whole line like OK or ERROR
+  for (t = 0, bit = 1; (tok_match != 0) && (t < AT_TOKENS_COUNT); t++, bit <<= 1)
+    {
+      if ( (tok_match & bit) && (pgm_read_byte( (const char *)pgm_read_word(&AT_TOKENS[t]) + len ) == 0x00) )
+         { line_token = t + 1;
+           line_arg = len;
+         };
+    };
+  tok_match = 0;
+
+  // line ending with comma has one more, empty field
+  if ( (field_state == FLD_NEW) && (field_count > 0) && (field_count < AT_MAX_FIELDS) )
+     { field_off[field_count] = len;
+       field_len[field_count] = 0;
+       field_count++;
+     };
+}
+
+
+// ----------------------------------------------------------------------------------------------
+// field access - values are read directly from 'response', nothing is copied unless asked for
+// ----------------------------------------------------------------------------------------------
+
+// checks if field 'n' is exactly the PROGMEM string
+uint8_t field_is_P(uint8_t n, const char *s) {
+  if (n >= field_count) return 0;
+  return ( (field_len[n] == strlen_P(s)) && (strncmp_P((const char *)response + field_off[n], s, field_len[n]) == 0) );
+}
+
+// decimal value of field 'n', conversion stops at first non digit, missing field gives 0
+uint16_t field_uint(uint8_t n) {
+  uint16_t v = 0;
+  uint8_t i, c;
+
+  if (n >= field_count) return 0;
+  for (i = 0; i < field_len[n]; i++)
+    {
+      c = response[field_off[n] + i];
+      if ( (c < '0') || (c > '9') ) break;
+      v = v * 10 + (c - '0');
+    };
+  return v;
+}
+
+// copies field 'n' as NULL terminated string to 'dst' of 'size' bytes, returns length copied
+uint8_t field_copy(uint8_t n, uint8_t *dst, uint8_t size) {
+  uint8_t i = 0;
+
+  if (n < field_count)
+    for (; (i < field_len[n]) && (i < size - 1); i++)  dst[i] = response[field_off[n] + i];
+  dst[i] = 0x00;
+  return i;
+}
+
+// value of hexadecimal field 'n' like "00C3" of +CREG:
+uint16_t field_hex(uint8_t n) {
+  uint16_t v = 0;
+  uint8_t i, c;
+
+  if (n >= field_count) return 0;
+  for (i = 0; i < field_len[n]; i++)
+    {
+      c = response[field_off[n] + i];
+      if ( (c >= '0') && (c <= '9') )       c = c - '0';
+      else if ( (c >= 'A') && (c <= 'F') )  c = c - 'A' + 10;
+      else if ( (c >= 'a') && (c <= 'f') )  c = c - 'a' + 10;
+      else break;
+      v = (v << 4) | c;
+    };
+  return v;
+}
+
+
+// ----------------------------------------------------------------------------------------------
+// every +CREG: line updates cached registration state, no matter which command was waiting for it
+// answer to AT+CREG? begins with <n> ( 2 or 4 fields ), unsolicited report does not ( 1 or 3 fields )
+// LAC and CI are given only when SIM800L is registered
+// ----------------------------------------------------------------------------------------------
+void reg_update(void)
+{
+  uint8_t f;
+
+  f = (field_count & 1) ? 0 : 1;
+  reg_stat = field_uint(f);
+  if (field_count > (f + 2))
+     { reg_lac = field_hex(f + 1);
+       reg_ci = field_hex(f + 2);
+     };
+  reg_updated = millis();
+}
+
+// registered in HPLMN ( 1 ) or ROAMING NETWORK ( 5 ) according to fresh cache
+uint8_t reg_registered(void)
+{
+  if ( (reg_stat != 1) && (reg_stat != 5) )  return 0;
+  return ( (millis() - reg_updated) < REG_CACHE_TIME );
+}
+
+
+
+// ----------------------------------------------------------------------------------------------------------------------------
+// read PHONE NUMBER of SMS sender from +CMT: or +CMGL: line or of the caller from +CLIP: line in response buffer and copy it
+// to buffer 'phonenumber' for SMS sending, returns 0 when there is no number ( like hidden number of the caller )
+// ----------------------------------------------------------------------------------------------------------------------------
+uint8_t readphonenumber()
+{
+  uint8_t n;
+
+  // +CMT: "<MSISDN>","<alpha>","<timestamp>" / +CLIP: "<MSISDN>",<type>,... - MSISDN number is the first field
+  // +CMGL: <index>,"<stat>","<MSISDN>",... - the third field
+  if ( (line_token != TOK_CMT) && (line_token != TOK_CLIP) && (line_token != TOK_CMGL) ) return (0);
+  n = (line_token == TOK_CMGL) ? 2 : 0;
+  if ( (field_count <= n) || (field_len[n] == 0) ) return (0);
+  field_copy(n, phonenumber, sizeof(phonenumber));
+
+ return (1);
+}
+
+// ----------------------------------------------------------------------------------------------------------------------------
+// put 'number' into reply queue unless it is already there, 'query_last' is its entry, returns 0 when queue is full
+// ----------------------------------------------------------------------------------------------------------------------------
+uint8_t query_put(const uint8_t *number, uint8_t kind)
+{
+  uint8_t i;
+
+  for (i = 0; i < query_count; i++)
+     if (strcmp((const char *)query_numbers[i], (const char *)number) == 0)
+        { // reply which includes more wins, periodic report may be skipped so it loses
+          if (kind > query_kind[i])  query_kind[i] = kind;
+          query_last = i;
+          return (1);
+        };
+  if (query_count >= QUERY_QUEUE_SIZE) return (0);
+  strcpy((char *)query_numbers[query_count], (const char *)number);
+  query_kind[query_count] = kind;
+  query_command[query_count] = 0;
+  query_last = query_count;
+  query_count++;
+
+ return (1);
+}
+
+// ----------------------------------------------------------------------------------------------------------------------------
+// put number from current line into reply queue unless it is already there, returns 0 when there is no number
+// or the queue is full
+// ----------------------------------------------------------------------------------------------------------------------------
+uint8_t query_add()
+{
+  if (readphonenumber() == 0) return (0);
+  return query_put(phonenumber, QUERY_READING);
+}
+
+// ----------------------------------------------------------------------------------------------------------------------------
+// put sender of stored SMS from +CMGL: line into reply queue and keep SMS index for deleting it, SMS without number
+// is deleted too, returns 0 when there is no number or the queue is full ( SMS stays unread in SIM then )
+// ----------------------------------------------------------------------------------------------------------------------------
+uint8_t sms_stored_add()
+{
+  uint8_t index, number;
+
+  if (sms_stored_count >= QUERY_QUEUE_SIZE) return (0);
+  index = field_uint(0);
+  number = readphonenumber();
+  if ( number && (query_put(phonenumber, QUERY_READING) == 0) ) return (0);
+  sms_stored[sms_stored_count] = index;
+  sms_stored_count++;
+
+ return (number);
+}
+
+// ----------------------------------------------------------------------------------------------------------------------------
+// SETTINGS in EEPROM and SMS COMMANDS - text of SMS ( the line after +CMT: / +CMGL: ) is compared with command table,
+// the command gets the rest of the line as argument, sender of any command gets STATUS reply instead of the reading
+// text of SMS which is not a command is ignored like before and only the reading is sent back
+// ----------------------------------------------------------------------------------------------------------------------------
+
+void config_load(void)
+{
+  eeprom_read_block(&cfg, &cfg_eeprom, sizeof(cfg));
+  if (cfg.version != CFG_VERSION)
+     { cfg.version = CFG_VERSION;
+       cfg.interval = 0;
+       cfg.threshold = 0;
+       cfg.mode = MODE_SLEEP;
+       cfg.owner[0] = 0x00;
+       cfg.low[ALARM_TEMPERATURE] = 0;
+       cfg.high[ALARM_TEMPERATURE] = 0;
+       cfg.low[ALARM_HUMIDITY] = 0;
+       cfg.high[ALARM_HUMIDITY] = 0;
+     };
+}
+
+void config_save(void)
+{
+  eeprom_update_block(&cfg, &cfg_eeprom, sizeof(cfg));
+}
+
+// decimal number with optional one digit fraction like "5" or "5.5" as 10 times value, 0xFFFF if there is no number
+// '*p' is moved behind the number, too big number saturates at TENTHS_MAX
+#define TENTHS_MAX         (0xFFFE)
+uint16_t parse_tenths(const char **p)
+{
+  uint32_t v;
+
+  while (**p == ' ')  (*p)++;
+  if ( (**p < '0') || (**p > '9') )  return 0xFFFF;
+  v = 0;
+  while ( (**p >= '0') && (**p <= '9') )
+     { if (v <= TENTHS_MAX)  v = (v * 10) + (**p - '0');
+       (*p)++;
+     };
+  v = v * 10;
+  if ( (**p == '.') && ((*p)[1] >= '0') && ((*p)[1] <= '9') )
+     { v += (*p)[1] - '0';
+       (*p) += 2;
+     };
+  if (v > TENTHS_MAX)  v = TENTHS_MAX;
+  return v;
+}
+
+// number like parse_tenths() with optional '-' sign, saturates at +/-32767, TENTHS_NONE if there is no number
+#define TENTHS_NONE        (-32767 - 1)
+int16_t parse_signed_tenths(const char **p)
+{
+  uint16_t v;
+  uint8_t minus;
+
+  while (**p == ' ')  (*p)++;
+  minus = (**p == '-');
+  if (minus)  (*p)++;
+  v = parse_tenths(p);
+  if (v == 0xFFFF)  return TENTHS_NONE;
+  if (v > 32767)  v = 32767;
+  return minus ? -(int16_t)v : (int16_t)v;
+}
+
+// INT <minutes> - periodic report to the sender, 0 turns reports off
+void cmd_interval(const char *arg)
+{
+  uint16_t v;
+
+  v = parse_tenths(&arg);
+  if (v == 0xFFFF)  return;
+  cfg.interval = v / 10;
+  if (cfg.interval > INTERVAL_MAX)  cfg.interval = INTERVAL_MAX;
+  next_report = millis() + (cfg.interval * 60000UL);
+  report_sent = 0;
+  config_save();
+}
+
+// TH <x.y> - periodic report only when temperature changed at least by x.y since last report, 0 - always
+void cmd_threshold(const char *arg)
+{
+  uint16_t v;
+
+  v = parse_tenths(&arg);
+  if (v == 0xFFFF)  return;
+  cfg.threshold = v;
+  config_save();
+}
+
+// MODE SLEEP / MODE AWAKE - SIM800L sleep policy between queries
+void cmd_mode(const char *arg)
+{
+  while (*arg == ' ')  arg++;
+  if (strncasecmp_P(arg, MODE_SLEEP_TXT, strlen_P(MODE_SLEEP_TXT)) == 0)  cfg.mode = MODE_SLEEP;
+  else if (strncasecmp_P(arg, MODE_AWAKE_TXT, strlen_P(MODE_AWAKE_TXT)) == 0)  cfg.mode = MODE_AWAKE;
+  else return;
+  config_save();
+}
+
+// STATUS - nothing to change, only the reply
+void cmd_status(const char *arg)
+{
+}
+
+// <low> <high> - alarm bounds of 'channel', below zero too, alarm SMS go to the owner like periodic reports,
+// single 0 ( or high not above low ) turns the alarm off, the sensor is checked right at next wakeup
+void cmd_limits(uint8_t channel, const char *arg)
+{
+  int16_t low, high;
+
+  low = parse_signed_tenths(&arg);
+  if (low == TENTHS_NONE)  return;
+  high = parse_signed_tenths(&arg);
+  if ( (high == TENTHS_NONE) || (high <= low) )  low = high = 0;
+  cfg.low[channel] = low;
+  cfg.high[channel] = high;
+  alarm_state[channel] = ALARM_NONE;
+  alarm_count[channel] = 0;
+  next_check = millis();
+  config_save();
+}
+
+// TLIM <low> <high> - temperature alarm
+void cmd_tlim(const char *arg)
+{
+  cmd_limits(ALARM_TEMPERATURE, arg);
+}
+
+// HLIM <low> <high> - humidity alarm
+void cmd_hlim(const char *arg)
+{
+  cmd_limits(ALARM_HUMIDITY, arg);
+}
+
+typedef void (*sms_handler)(const char *arg);
+#define SMS_COMMANDS_COUNT (6)
+const char * const SMS_COMMANDS[SMS_COMMANDS_COUNT] PROGMEM = { CMD_INT, CMD_TH, CMD_MODE, CMD_STATUS, CMD_TLIM, CMD_HLIM };
+const sms_handler SMS_HANDLERS[SMS_COMMANDS_COUNT] PROGMEM = { cmd_interval, cmd_threshold, cmd_mode, cmd_status,
+                                                               cmd_tlim, cmd_hlim };
+
+// text of SMS from 'query_last' is in 'response', keywords are not case sensitive, the command is only queued
+// with the sender, query_apply() runs it
+void sms_command(void)
+{
+  uint8_t i, len;
+  const char *keyword;
+
+  for (i = 0; i < SMS_COMMANDS_COUNT; i++)
+    {
+      keyword = (const char *)pgm_read_word(&SMS_COMMANDS[i]);
+      len = strlen_P(keyword);
+      if ( (strncasecmp_P((const char *)response, keyword, len) == 0) &&
+           ((response[len] == ' ') || (response[len] == 0x00)) )
+         {
+           query_command[query_last] = i + 1;
+           strncpy(query_arg[query_last], (const char *)response + len, SMS_ARG_SIZE - 1);
+           query_arg[query_last][SMS_ARG_SIZE - 1] = 0x00;
+           query_kind[query_last] = QUERY_STATUS;
+           return;
+         };
+    };
+}
+
+// run command queued with entry 'q' of reply queue, settings are locked to the number which sent the first command
+// ( it becomes the owner ), commands of other numbers are ignored like any other text except STATUS which changes
+// nothing - the sender gets only the reading then
+void query_apply(uint8_t q)
+{
+  sms_handler handler;
+
+  if (query_command[q] == 0)  return;
+  handler = (sms_handler)pgm_read_word(&SMS_HANDLERS[query_command[q] - 1]);
+  query_command[q] = 0;
+  if (handler != cmd_status)
+     {
+       if (cfg.owner[0] == 0x00)  strcpy((char *)cfg.owner, (const char *)query_numbers[q]);
+       else if (strcmp((const char *)cfg.owner, (const char *)query_numbers[q]) != 0)
+          { query_kind[q] = QUERY_READING;
+            return;
+          };
+     };
+  handler(query_arg[q]);
+}
+
+// decimal text of 'v'
+const char *format_uint(uint32_t v)
+{
+  uint8_t i;
+
+  i = 10;
+  numtxt[10] = 0x00;
+  do {
+       numtxt[--i] = (v % 10) + 48;
+       v = v / 10;
+     } while (v != 0);
+  return (const char *)(numtxt + i);
+}
+
+// sends 10 times value 'v' as decimal number with one digit fraction, '-' sign when below zero
+void send_tenths(int32_t v)
+{
+  if (v < 0)
+     { send_uart(45);   // the MINUS character
+       v = -v;
+     };
+  uart_puts(format_uint(v / 10));
+  send_uart(46);   // the DOT character
+  send_uart((v % 10) + 48);
+}
+
+// ----------------------------------------------------------------------------------------------------------------------------
+// ALARM ENGINE - sensor is sampled every ALARM_SAMPLE_INTERVAL while some alarm is set, owner gets SMS when state
+// of a channel changes ( alarm raised or cleared )
+// ----------------------------------------------------------------------------------------------------------------------------
+
+// 1 when alarm bounds are set for 'channel'
+uint8_t alarm_on(uint8_t channel)
+{
+  return (cfg.high[channel] > cfg.low[channel]);
+}
+
+// 1 when alarm bounds are set for some channel
+uint8_t alarm_enabled(void)
+{
+  return ( alarm_on(ALARM_TEMPERATURE) || alarm_on(ALARM_HUMIDITY) );
+}
+
+// new sample 'v' of 'channel', returns 1 when alarm state of the channel has changed
+uint8_t alarm_check(uint8_t channel, int16_t v, int16_t low, int16_t high, int16_t hyst)
+{
+  uint8_t state;
+
+  state = ALARM_NONE;
+  if ( (v < low) || ((alarm_state[channel] == ALARM_LOW) && (v < low + hyst)) )  state = ALARM_LOW;
+  if ( (v > high) || ((alarm_state[channel] == ALARM_HIGH) && (v > high - hyst)) )  state = ALARM_HIGH;
+
+  if (state == alarm_state[channel])
+     { alarm_count[channel] = 0;
+       return 0;
+     };
+  if (++alarm_count[channel] < ALARM_DEBOUNCE)  return 0;
+  alarm_state[channel] = state;
+  alarm_count[channel] = 0;
+  return 1;
+}
+
+// sample of both channels ( 10 times value ), channels without bounds are skipped, returns 1 when some state has changed
+uint8_t alarm_sample(int16_t temperature, int16_t humidity)
+{
+  uint8_t changed;
+
+  changed = 0;
+  if (alarm_on(ALARM_TEMPERATURE))
+     changed |= alarm_check(ALARM_TEMPERATURE, temperature, cfg.low[ALARM_TEMPERATURE], cfg.high[ALARM_TEMPERATURE],
+                            ALARM_HYSTERESIS);
+  if (alarm_on(ALARM_HUMIDITY))
+     changed |= alarm_check(ALARM_HUMIDITY, humidity, cfg.low[ALARM_HUMIDITY], cfg.high[ALARM_HUMIDITY],
+                            ALARM_HYSTERESIS);
+  return changed;
+}
+
+// sends state of 'channel' for alarm SMS
+void send_alarm_state(uint8_t channel)
+{
+  if (alarm_on(channel) == 0)  uart_puts_P(ALARM_OFF_TXT);
+  else  uart_puts_P((const char *)pgm_read_word(&ALARM_STATES[alarm_state[channel]]));
+}
+
+
+// *********************************************************************************************************
+// READLINE from serial port that starts with CRLF and ends with CRLF and put to 'response' buffer what read
+// chars are taken from RX ring buffer, MCU stays in IDLE sleep between chars
+// every char is passed to streaming parser so line_token / line_arg are ready when the line ends
+// returns READLINE_TIMEOUT if whole line was not received within 'timeout' ms ( counted by system tick )
+// *********************************************************************************************************
+uint8_t readline_timeout(uint32_t timeout)
+{
+  uint32_t start;
+  uint16_t char1;
+
+  start = millis();
+  response_pos = 0;
+  parse_begin();
+
+  while ( (millis() - start) < timeout )
+   {
+      char1 = uart_getc();
+      // nothing received - sleep until next char or next timer tick
+      if (char1 == UART_NO_DATA)
+         { uart_wait_rx();
+           continue;
+         };
+
+      // if CR-LF combination detected start to copy the response
+      if   (  char1 != 0x0a && char1 != 0x0d ) 
+         { if ( response_pos < (BUFFER_SIZE - 1) )
+              { response[response_pos] = char1; 
+                parse_char(char1, response_pos);
+                response_pos++;
+              };
+           continue;
+         };
+
+      // text of SMS ends with CR even when it is empty, LF ( rest of CR/LF after header or line break in text ) is skipped
+      if ( (sms_body != SMS_BODY_NONE) && (char1 == 0x0a) )  continue;
+
+      // if the line was received and this is only CR/LF ending, otherwise skip CRLF and wait for valuable char
+      if ( (response_pos > 0) || (sms_body != SMS_BODY_NONE) ) // this is EoL
+         { response[response_pos] = '\0';
+           parse_end(response_pos);
+           if (line_token == TOK_CREG)  reg_update();
+           // SMS queries are queued whenever they come, even while replying to previous ones, text follows in next line
+           // ( a header where text was expected means the text was lost )
+           if (line_token == TOK_CMT)  sms_body = query_add() ? SMS_BODY_QUERY : SMS_BODY_SKIP;
+           else if (line_token == TOK_CMGL)  sms_body = sms_stored_add() ? SMS_BODY_QUERY : SMS_BODY_SKIP;
+           // text of SMS may be a command, whatever it says it is not a result code for at_wait()
+           else if (sms_body != SMS_BODY_NONE)
+              { if (sms_body == SMS_BODY_QUERY)  sms_command();
+                sms_body = SMS_BODY_NONE;
+                line_token = TOK_NONE;
+                field_count = 0;
+              };
+           response_pos = 0;
+           return READLINE_OK;
+         };
+   };
+
+  // keep what was received so far for diagnostics
+  response[response_pos] = '\0';
+  response_pos = 0;
+  return READLINE_TIMEOUT;
+}
 
 
 
-// -------------------------------------------------------------------------------------------------------
-// ---------------------------------------- DHT22  library CODE ------------------------------------------
-// -------------------------------------------------------------------------------------------------------
+// *********************************************************************************************************
+// AT command engine - wait for final result code of a command sent to SIM800L
+// if 'urc' is TOK_NONE waits for OK, otherwise waits for line recognised as 'urc' token ( OK lines are skipped )
+// ERROR / +CME ERROR / +CMS ERROR finish the wait with AT_ERROR, no answer within 'timeout' ms gives AT_TIMEOUT
+// returns as soon as the modem answers, 'response' buffer keeps the line that ended the wait
+// *********************************************************************************************************
+uint8_t at_wait(uint8_t urc, uint32_t timeout)
+{
+  uint32_t start, elapsed;
 
+  start = millis();
 
-void  dht_init(void)
+  while (1)
+   {
+     elapsed = millis() - start;
+     if (elapsed >= timeout) return AT_TIMEOUT;
+     if (readline_timeout(timeout - elapsed) == READLINE_TIMEOUT) return AT_TIMEOUT;
+
+     if ( (urc != TOK_NONE) && (line_token == urc) )  return AT_OK;
+     if ( (line_token == TOK_ERROR) || (line_token == TOK_CME_ERROR) || (line_token == TOK_CMS_ERROR) )  return AT_ERROR;
+     if ( (urc == TOK_NONE) && (line_token == TOK_OK) )  return AT_OK;
+     // any other line ( echo, intermediate response, URC ) is ignored
+   };
+}
+
+
+// *********************************************************************************************************
+// wait for '>' prompt of SIM800L after AT+CMGS, the prompt is not ended with CR/LF
+// *********************************************************************************************************
+uint8_t at_wait_prompt(uint32_t timeout)
 {
-   DHT_PIN_INPUT();
-   DHT_PIN_HIGH();
+  uint32_t start;
+  uint16_t char1;
+
+  start = millis();
+  while ( (millis() - start) < timeout )
+   {
+     char1 = uart_getc();
+     if (char1 == '>') return AT_OK;
+     if (char1 == UART_NO_DATA) uart_wait_rx();
+   };
+  return AT_TIMEOUT;
 }
 
-static int8_t   dht_await_state(uint8_t state)
+
+// *********************************************************************************************************
+// take lines waiting in RX ring buffer out before next command so old responses do not end the wait for new
+// ones, lines are not dropped - +CMT: and text of SMS among them are queued ( SMS routed by AT+CNMI=1,2 are
+// not stored in SIM and would be lost ), CR / LF between lines is skipped without waiting unless it ends empty text of SMS
+// *********************************************************************************************************
+void readline_drain(void)
 {
-    uint8_t counter = 0;
-    while ((!DHT_PIN_READ() == state) && (++counter < DHT_TIMEOUT)) 
-     { 
-     // Delay 1 cycles
-     // 1us at 1.0 MHz CLOCK
-     asm volatile (
-        "    nop"	"\n"
-        );
+  while ( (rx_head != rx_tail) || sms_body )
+     {
+       if ( (rx_head != rx_tail) && (sms_body == SMS_BODY_NONE) &&
+            ((rx_ring[rx_tail] == 0x0d) || (rx_ring[rx_tail] == 0x0a)) )  uart_getc();
+       else if (readline_timeout(RX_DRAIN_TIMEOUT) == READLINE_TIMEOUT)  break;
      };
-    return counter;
 }
 
 
-int8_t dht_read(uint8_t *temperature_hi, uint8_t *temperature_lo, uint8_t *humidity_hi, uint8_t *humidity_lo)
+// *********************************************************************************************************
+// send PROGMEM AT command and wait for OK / ERROR, see at_wait()
+// *********************************************************************************************************
+uint8_t at_command(const char *cmd, uint32_t timeout)
 {
-    uint8_t i, j, data[5] = {0, 0, 0, 0, 0};
+  readline_drain();
+  uart_puts_P(cmd);
+  return at_wait(TOK_NONE, timeout);
+}
 
-    // send start sequence 1 LOW pulse for 2 miliseconds
-    DHT_PIN_OUTPUT();
-    DHT_PIN_LOW();
 
-    // Delay 20 000 cycles
-    // 20ms at 1 MHz
-    asm volatile (
-         "    ldi  r18, 26"	"\n"
-         "    ldi  r19, 249"	"\n"
-         "1:  dec  r19"	"\n"
-         "    brne 1b"	"\n"
-         "    dec  r18"	"\n"
-         "    brne 1b"	"\n"
-          );
+// *********************************************************************************************************
+// send PROGMEM AT command and wait for command specific response line ( like +HTTPACTION: ), see at_wait()
+// *********************************************************************************************************
+uint8_t at_command_urc(const char *cmd, uint8_t urc, uint32_t timeout)
+{
+  readline_drain();
+  uart_puts_P(cmd);
+  return at_wait(urc, timeout);
+}
 
-    DHT_PIN_HIGH();
-    DHT_PIN_INPUT();
 
-    // read response sequence - 1 pulse  as preparation before sending measurement
-    if (dht_await_state(0) < 0) return DHT_ERR_TIMEOUT;
-    if (dht_await_state(1) < 0) return DHT_ERR_TIMEOUT;
-    if (dht_await_state(0) < 0) return DHT_ERR_TIMEOUT;
-    
+// *********************************************************************************************************
+// list SMS stored in SIM and not read yet, senders are queued ( readline_timeout ) and SMS which got into the
+// queue are deleted, returns count of deleted SMS - those which did not fit are listed again in next pass,
+// 0 when nothing was deleted or SMS_LIST_PASSES listings were made since last sleep
+// *********************************************************************************************************
+uint8_t sms_list(void)
+{
+  uint8_t i, deleted;
+
+  if (sms_passes >= SMS_LIST_PASSES)  return 0;
+  sms_passes++;
+  sms_stored_count = 0;
+  at_command(LISTSMS, AT_TIMEOUT_CMGDA);
+  deleted = 0;
+  for (i = 0; i < sms_stored_count; i++)
+     {
+       readline_drain();
+       uart_puts_P(DELONESMS);
+       uart_puts(format_uint(sms_stored[i]));
+       uart_puts_P(ENDCMD);
+       if (at_wait(TOK_NONE, AT_TIMEOUT_CMD) == AT_OK)  deleted++;
+     };
+  return deleted;
+}
 
-    // read data - 40 bits - HOGH pulse length goves info aboit 0s and 1s 
-    for (i = 0; i < 5; ++i) {
-        for (j = 0; j < 8; ++j) 
-          {
-         // wait for next BIT to come
-         dht_await_state(1);
-         // do left shift
-         data[i] <<= 1;
-         // received BIT is "1" if waiting for LOW longer than 28 microseconds - 
-         // the value = 1 in comparision is experimental for 1MHz clock, 20 for 8MHz
-         if (dht_await_state(0) > 1)  data[i] |= 1;   
-          };
-    };
 
-    // check if checksum matches
-    if (data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF) ) 
-     { 
-    *temperature_hi = data[2];
-    *temperature_lo = data[3];
-    *humidity_hi = data[0];
-    *humidity_lo = data[1];
+// *********************************************************************************************************
+// signal quality from AT+CSQ - returns <rssi> 0..31, 99 when unknown or modem did not answer
+// *********************************************************************************************************
+uint8_t read_rssi(void)
+{
+  if (at_command_urc(SHOW_CSQ, TOK_CSQ, AT_TIMEOUT_CMD) != AT_OK) return 99;
+  if (field_count == 0) return 99;
+  return field_uint(0);
+}
 
-    }
-    else
-    {
-    *temperature_hi = 0;
-    *temperature_lo = 0;
-    *humidity_hi = 0;
-    *humidity_lo = 0;
 
-    }; 
+// *********************************************************************************************************
+// network time from AT+CCLK? - "yy/MM/dd,hh:mm:ss+zz" is put to 't' as yy,MM,dd,hh,mm,ss
+// returns AT_OK or AT_ERROR / AT_TIMEOUT when clock could not be read
+// *********************************************************************************************************
+uint8_t read_clock(uint8_t *t)
+{
+  uint8_t i, p;
 
-     
-    return DHT_ERR_OK;
+  if (at_command_urc(SHOW_CLOCK, TOK_CCLK, AT_TIMEOUT_CMD) != AT_OK) return AT_ERROR;
+  if ( (field_count == 0) || (field_len[0] < 17) ) return AT_ERROR;
+  for (i = 0; i < 6; i++)
+    {
+      p = field_off[0] + 3 * i;
+      t[i] = (response[p] - '0') * 10 + (response[p+1] - '0');
+    };
+  return AT_OK;
 }
 
 
-// ----------------------------------------------------------------------------------------------
-// init_uart
-// ----------------------------------------------------------------------------------------------
-void init_uart(void) {
-  // double speed by U2X0 flag = 1 to have 0.2% error rate on 9600 baud
- UCSR0A = (1<<U2X0);
-  // set baud rate from PRESCALER
- UBRR0H = (uint8_t)(MYUBBR>>8);
- UBRR0L = (uint8_t)(MYUBBR);
- UCSR0B|=(1<<TXEN0); //enable TX
- UCSR0B|=(1<<RXEN0); //enable RX
-  // set frame format for SIM808 communication
- UCSR0C|=(1<<UCSZ00)|(1<<UCSZ01); // no parity, 1 stop bit, 8-bit data 
-}
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// delay procedures based on 1 ms system tick, MCU stays in IDLE sleep meanwhile 
+// RX ring buffer keeps collecting chars from SIM800L during the delay
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// delay particular number of miliseconds
 
-// ----------------------------------------------------------------------------------------------
-// send_uart
-// Sends a single char to UART without ISR
-// ----------------------------------------------------------------------------------------------
-void send_uart(uint8_t c) {
-  // wait for empty data register
-  while (!(UCSR0A & (1<<UDRE0)));
-  // set data into data register
-  UDR0 = c;
+void delay_ms(uint32_t ms)
+{
+  uint32_t start;
+
+  start = millis();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  while ( (millis() - start) < ms )
+   {
+     sleep_mode();   // Timer0 interrupt wakes up MCU every 1 ms
+   };
 }
 
 
 
-// ----------------------------------------------------------------------------------------------
-// receive_uart
-// Receives a single char without ISR
-// ----------------------------------------------------------------------------------------------
-uint8_t receive_uart() {
-  while ( !(UCSR0A & (1<<RXC0)) ) 
-    ; 
-  return UDR0; 
-}
+// -------------------------------------------------------------------------------------------------------
+// ---------------------------------------- DHT22  library CODE ------------------------------------------
+// -------------------------------------------------------------------------------------------------------
+// DHT pin PB0 is ICP1 - Timer1 input capture timestamps every falling edge of the frame in microseconds
+// ICR1 keeps the time of the edge so interrupt latency does not change measured bit length
+// reading runs in background : dht_start() begins it, start pulse and frame are handled by Timer1
+// interrupts, dht_poll() tells when it is done and dht_wait() gives the result
 
 
-// ----------------------------------------------------------------------------------------------
-// function to search RX buffer for response  SUB IN RX_BUFFER STR
-// ----------------------------------------------------------------------------------------------
-uint8_t is_in_rx_buffer(char *str, char *sub) {
-   uint8_t i, j=0, k;
-    for(i=0; i<BUFFER_SIZE; i++)
-    {
-      if(str[i] == sub[j])
-     {
-       for(k=i, j=0; str[k] && sub[j]; j++, k++)  // if NOT NULL on each of strings
-            if(str[k]!=sub[j])   break; // if different - start comparision with next char
-       // if(!sub[j]) return 1; 
-        if(j == strlen(sub)) return 1;  // full substring has been found        
-      }
-     }
-     // substring not found
-    return 0;
+void  dht_init(void)
+{
+   DHT_PIN_INPUT();
+   DHT_PIN_HIGH();
 }
 
- 
 
-// ----------------------------------------------------------------------------------------------
-// uart_puts
-// Sends a string.
-// ----------------------------------------------------------------------------------------------
-void uart_puts(const char *s) {
-  while (*s) {
-    send_uart(*s);
-    s++;
-  }
+// falling edge - only its time is stored so the interrupt is as short as possible, bits are decoded
+// by dht_poll() ( edges are less than 256us apart so low byte of ICR1 is enough )
+ISR(TIMER1_CAPT_vect)
+{
+  uint8_t n;
+
+  n = dht_edges;
+  dht_times[n] = ICR1L;
+  n++;
+  // whole frame received, no more captures
+  if (n >= DHT_EDGES)  TIMSK1 = 0;
+  dht_edges = n;
 }
 
 
-
-// ----------------------------------------------------------------------------------------------
-// uart_puts_P
-// Sends a PROGMEM string.
-// ----------------------------------------------------------------------------------------------
-void uart_puts_P(const char *s) {
-  while (pgm_read_byte(s) != 0x00) {
-    send_uart(pgm_read_byte(s++));
-  }
+// cached reading is younger than DHT_FRESH_TIME
+uint8_t dht_fresh(void)
+{
+    return ( dht_cache_valid && ((millis() - dht_cache_time) < DHT_FRESH_TIME) );
 }
 
 
-// *********************************************************************************************************
-// READLINE from serial port that starts with CRLF and ends with CRLF and put to 'response' buffer what read
-// *********************************************************************************************************
-uint8_t readline()
-{
-  uint16_t char1, i , wholeline ;
-  // wait for first CR-LF or exit after timeout i cycles
-   i = 0;
-   wholeline = 0;
-   response_pos = 0;
-  //
-   do {
-      // read chars in pairs to find combination CR LF
-      char1 = receive_uart();
-      // if CR-LF combination detected start to copy the response
-      if   (  char1 != 0x0a && char1 != 0x0d && response_pos < BUFFER_SIZE ) 
-         { response[response_pos] = char1; 
-           response_pos++;
-         };
+// start background reading - send LOW start pulse, Timer1 compare match will end it
+// nothing is done while cached reading is fresh or the sensor has not rested after previous reading yet
+// ( dht_wait() starts the reading later then )
+void dht_start(void)
+{
+    if ( dht_fresh() || (dht_result == DHT_BUSY) || ((millis() - dht_started) < DHT_MIN_INTERVAL) )  return;
 
-      if    (  char1 == 0x0a || char1 == 0x0d )              
-         {  
-           // if the line was received and this is only CR/LF ending :
-           if (response_pos > 0) // this is EoL
-               { response[response_pos] = NULL;
-                 response_pos = 0;
-                  wholeline = 1;  };
-          // just skip this CRLF character and wait for valuable one
-               
-         };
-      // if buffer is empty exit from function there is nothing to read from
-      i++;
-      } while ( wholeline == 0);
+    dht_edges = 0;
+    dht_result = DHT_BUSY;
+    dht_started = millis();
 
-return 1;
-}
+    // send start sequence 1 LOW pulse for 20 miliseconds
+    DHT_PIN_OUTPUT();
+    DHT_PIN_LOW();
 
+    // Timer1 counting microseconds, capture on falling edge with noise canceler
+    TCCR1A = 0;
+    TCNT1 = 0;
+    OCR1A = DHT_START_PULSE;
+    TIFR1 = (1<<OCF1A) | (1<<ICF1);
+    TIMSK1 = (1<<OCIE1A);
+    TCCR1B = (1<<ICNC1) | DHT_T1_PRESCALER;
+}
 
 
-// ----------------------------------------------------------------------------------------------------------------------------
-// read SMS message PHONE NUMBER from +CMT: output and response buffer and copy it to buffer 'phonenumber' for SMS sending
-// ----------------------------------------------------------------------------------------------------------------------------
-uint8_t readsmsphonenumber()
+// end of start pulse - release the line and let the sensor answer
+ISR(TIMER1_COMPA_vect)
 {
-  // need 8bit ascii 
-  uint8_t char1;
-  uint8_t i;
+  DHT_PIN_HIGH();
+  DHT_PIN_INPUT();
+  TIFR1 = (1<<ICF1);
+  TIMSK1 = (1<<ICIE1);
+}
 
-  // 'i' is a safe fuse not to get out of response buffer
-  i = 0;
-  phonenumber_pos = 0;
 
-  // reading from RESPONSE buffer of modem output, rewind to beginning of buffer
-  response_pos = 0;
+// returns DHT_BUSY while reading is in progress, then DHT_ERR_OK / DHT_ERR_TIMEOUT / DHT_ERR_CHECKSUM
+int8_t dht_poll(void)
+{
+    uint8_t i;
 
-  // wait for "+CMT:" and space
-      do { 
-           char1 = response[response_pos];
-           response_pos++;
-           i++;
-         } while ( (char1 != ':') && (i < BUFFER_SIZE) );
-
-      // wait for first quotation sign - there will be MSISDN number of sender
-      do { 
-           char1 = response[response_pos];
-           response_pos++;
-           i++;
-         } while ( (char1 != '\"') && (i < BUFFER_SIZE) );
-      // if quotation detected start to copy the response - phonenumber 
-      do  { 
-           char1 = response[response_pos];
-           response_pos++;
-           phonenumber[phonenumber_pos] = char1; 
-           phonenumber_pos++;
-           i++;
-         } while ( (char1 != '\"') && (i < BUFFER_SIZE) );    // until end of quotation
-     // put NULL to end the string phonenumber
-           phonenumber[phonenumber_pos-1] = NULL; 
-           phonenumber_pos=0;
-           response_pos = 0;
+    if (dht_result != DHT_BUSY)  return dht_result;
+    if ( (dht_edges < DHT_EDGES) && ((millis() - dht_started) < DHT_JOB_TIMEOUT) )  return DHT_BUSY;
 
- return (1);
-}
+    // frame received or sensor did not answer in time - stop Timer1
+    TIMSK1 = 0;
+    TCCR1B = 0;
+    DHT_PIN_HIGH();
+    DHT_PIN_INPUT();
 
+    // first two edges are sensor response, next 40 edges end bits - bit value is given by time from previous
+    // falling edge ( LOW 50us + HIGH 26us or 70us )
+    for (i = 0; i < 5; i++)  dht_data[i] = 0;
+    if (dht_edges >= DHT_EDGES)
+       for (i = 2; i < DHT_EDGES; i++)
+          {
+            dht_data[(i - 2) >> 3] <<= 1;
+            if ( (uint8_t)(dht_times[i] - dht_times[i - 1]) > DHT_BIT_THRESHOLD )  dht_data[(i - 2) >> 3] |= 1;
+          };
 
+    // check if all bits came and checksum matches
+    if (dht_edges < DHT_EDGES)  dht_result = DHT_ERR_TIMEOUT;
+    else if (dht_data[4] == ((dht_data[0] + dht_data[1] + dht_data[2] + dht_data[3]) & 0xFF) )  dht_result = DHT_ERR_OK;
+    else  dht_result = DHT_ERR_CHECKSUM;
 
+    // keep good reading for next queries
+    if (dht_result == DHT_ERR_OK)
+     {
+       for (i = 0; i < 4; i++)  dht_cache[i] = dht_data[i];
+       dht_cache_time = dht_started;
+       dht_cache_valid = 1;
+     };
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// delay procedure ASM based because _delay_ms() is working bad for 1 MHz clock MCU
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    return dht_result;
+}
 
-// delay partucular number of seconds 
 
-void delay_sec(uint8_t i)
+// gives fresh cached values or waits in IDLE sleep until background reading is done, zeros if reading failed
+// when no reading is running and cache is old ( start was too early, or reading failed ) the sensor is read
+// again as soon as it has rested
+int8_t dht_wait(uint8_t *temperature_hi, uint8_t *temperature_lo, uint8_t *humidity_hi, uint8_t *humidity_lo)
 {
-while(i > 0)
-{
-// Generated by delay loop calculator
-// at http://www.bretmulvey.com/avrdelay.html
-//
-// Delay 1 000 000 cycles
-// 1s at 1 MHz
-
-asm volatile (
-    "    ldi  r18, 6"	"\n"
-    "    ldi  r19, 19"	"\n"
-    "    ldi  r20, 174"	"\n"
-    "1:  dec  r20"	"\n"
-    "    brne 1b"	"\n"
-    "    dec  r19"	"\n"
-    "    brne 1b"	"\n"
-    "    dec  r18"	"\n"
-    "    brne 1b"	"\n"
-    "    rjmp 1f"	"\n"
-    "1:"	"\n"
-);
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    if ( (dht_result != DHT_BUSY) && !dht_fresh() )
+     {
+       while ( (millis() - dht_started) < DHT_MIN_INTERVAL )  sleep_mode();
+       dht_start();
+     };
+    while (dht_poll() == DHT_BUSY)
+     {
+       sleep_mode();
+     };
 
-i--;  // decrease another second
+    if (dht_fresh())
+     { 
+    *temperature_hi = dht_cache[2];
+    *temperature_lo = dht_cache[3];
+    *humidity_hi = dht_cache[0];
+    *humidity_lo = dht_cache[1];
+    return DHT_ERR_OK;
+    }
+    else
+    {
+    *temperature_hi = 0;
+    *temperature_lo = 0;
+    *humidity_hi = 0;
+    *humidity_lo = 0;
 
-};    // repeat until i not zero
+    }; 
 
+     
+    return dht_result;
 }
 
 
@@ -419,25 +1550,19 @@ i--;  // decrease another second
 // *********************************************************************************************************
 uint8_t checkat()
 {
-  uint8_t initialized2;
+  uint8_t initialized2, attempt;
 
 // wait for first OK while sending AT - autosensing speed on SIM800L, but we are working 9600 bps
 // SIM 800L can be set by AT+IPR=9600  to fix this speed
 // which I do recommend by connecting SIM800L to PC using putty and FTD232 cable
+// returns 0 when SIM800L did not answer to CHECKAT_ATTEMPTS probes
 
                  initialized2 = 0;
-              do { 
-               uart_puts_P(AT);
-                if (readline()>0)
-                   {
-                    memcpy_P(buf, ISOK, sizeof(ISOK));                     
-                   if (is_in_rx_buffer(response, buf) == 1)  initialized2 = 1;                  
-                   };
-               delay_sec(1);
-               } while (initialized2 == 0);
+              for (attempt = 0; (attempt < CHECKAT_ATTEMPTS) && (initialized2 == 0); attempt++)
+               if (at_command(AT, AT_TIMEOUT_PROBE) == AT_OK)  initialized2 = 1;
 
         // send ECHO OFF
-              uart_puts_P(ECHO_OFF);
+              if (initialized2)  at_command(ECHO_OFF, AT_TIMEOUT_CMD);
 
              return initialized2;
 }
@@ -448,76 +1573,228 @@ uint8_t checkat()
 uint8_t checkpin()
 {
 
-  uint8_t initialized2;
-     // readline and wait for PIN CODE STATUS if needed send PIN 1111 to SIM card if required
+  uint8_t initialized2, attempt;
+     // ask for PIN CODE STATUS and send PIN 1111 to SIM card if required, SIM card still starting up answers
+     // with +CME ERROR and reports its state later with +CPIN: URC, so no fixed delays are needed
+     // returns 0 when SIM card is not ready after CHECKPIN_ATTEMPTS polls ( missing, wrong PIN, PUK locked )
                   initialized2 = 0;
-              do { 
-		delay_sec(2);
-               uart_puts_P(SHOW_PIN);
-                if (readline()>0)
+              for (attempt = 0; (attempt < CHECKPIN_ATTEMPTS) && (initialized2 == 0); attempt++) { 
+                if (at_command_urc(SHOW_PIN, TOK_CPIN, AT_TIMEOUT_CMD) != AT_OK)
                    {
-                    memcpy_P(buf, PIN_IS_READY, sizeof(PIN_IS_READY));
-                  if (is_in_rx_buffer(response, buf ) == 1)       initialized2 = 1;                                         
-                    memcpy_P(buf, PIN_MUST_BE_ENTERED, sizeof(PIN_MUST_BE_ENTERED));
-                  if (is_in_rx_buffer(response, buf) == 1)     
-                        {  uart_puts_P(ENTER_PIN);   // ENTER PIN 1111
-                           delay_sec(1);
-                        };                  
-                    };
+                     at_wait(TOK_CPIN, AT_TIMEOUT_CPIN);
+                     continue;
+                   };
+                if ( field_is_P(0, PIN_IS_READY) )       initialized2 = 1;                                         
+                if ( field_is_P(0, PIN_MUST_BE_ENTERED) )     
+                   {  // ENTER PIN 1111 and wait for +CPIN: READY
+                      if ( (at_command(ENTER_PIN, AT_TIMEOUT_CMD) == AT_OK) &&
+                           (at_wait(TOK_CPIN, AT_TIMEOUT_CPIN) == AT_OK) && field_is_P(0, PIN_IS_READY) )  initialized2 = 1;
+                   };
                   
-              } while (initialized2 == 0);
+              };
    return initialized2;
 }
 
 
+// -------------------------------------------------------------------------------
+// WATCHDOG based sleep service - MCU sleeps in POWER DOWN mode and is woken up by WDT interrupt
+// WDT oscillator is not precise ( +/- 10% ) so its real period is measured against system tick
+// and system tick is advanced by measured period after every WDT wakeup ( drift correction )
+// -------------------------------------------------------------------------------
+
+void wdt_interrupt(uint8_t prescaler)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+    wdt_reset();
+    MCUSR &= ~(1 << WDRF);
+    WDTCSR = (1 << WDCE) | (1 << WDE);    // timed sequence to change WDT settings
+    WDTCSR = (1 << WDIE) | prescaler;     // interrupt mode only, no reset
+    };
+}
+
+void wdt_stop(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+    wdt_reset();
+    MCUSR &= ~(1 << WDRF);
+    WDTCSR = (1 << WDCE) | (1 << WDE);
+    WDTCSR = 0;
+    };
+}
+
+ISR(WDT_vect)
+{
+  ticks_ms += wdt_add_ms;     // Timer0 is stopped in POWER DOWN mode
+  wdt_fired = 1;
+}
+
+// measure real length of 1 second WDT period with Timer0 tick while MCU is in IDLE mode
+void wdt_calibrate(void)
+{
+  uint32_t start;
+
+  wdt_add_ms = 0;             // Timer0 is counting during calibration
+  wdt_fired = 0;
+  wdt_interrupt(WDT_1S);
+  start = millis();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  while (wdt_fired == 0)  sleep_mode();
+  wdt_period_ms = (uint16_t)((millis() - start) * 8);
+  wdt_calibrated_at = millis();
+  wdt_stop();
+}
+
+// power down until WDT interrupt ( or other enabled interrupt like INT0 )
+void powerdown(uint8_t prescaler, uint16_t period_ms)
+{
+  wdt_add_ms = period_ms;
+  wdt_fired = 0;
+  wdt_interrupt(prescaler);
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  cli();
+  sleep_enable();
+  sei();                      // SLEEP is executed before any pending interrupt
+  sleep_cpu();
+  sleep_disable();
+}
+
+// sleep until system tick reaches 'tick' ( milliseconds ), 8 second WDT periods first,
+// then 1 second periods, the rest in IDLE mode on Timer0
+void sleep_until(uint32_t tick)
+{
+  int32_t remaining;
+
+  if ( (wdt_period_ms == 0) || ((millis() - wdt_calibrated_at) > WDT_CALIBRATION_INTERVAL) )  wdt_calibrate();
+
+  // USART is stopped in POWER DOWN mode so send everything what is still in TX queue
+  uart_flush_tx();
+
+  while (1)
+   {
+     remaining = (int32_t)(tick - millis());
+     if (remaining <= 0) break;
+     if (remaining >= wdt_period_ms)            powerdown(WDT_8S, wdt_period_ms);
+     else if (remaining >= (wdt_period_ms / 8)) powerdown(WDT_1S, wdt_period_ms / 8);
+     else { delay_ms(remaining);
+            break;
+          };
+   };
+
+  wdt_stop();
+}
+
+
+// *********************************************************************************************************
+// wake up SIM800L from SLEEP MODE ( AT+CSCLK=2 ) - first AT only wakes up the modem and may be lost
+// *********************************************************************************************************
+uint8_t modemwakeup()
+{
+  uint8_t attempt;
+
+  for (attempt = 0; attempt < 5; attempt++)
+     if (at_command(AT, AT_TIMEOUT_PROBE) == AT_OK) break;
+  return at_command(SLEEPOFF, AT_TIMEOUT_CMD);
+}
+
+// SIM800L does not answer or SIM card can not be used - radio off and SLEEP MODE of SIM800L ( PWRKEY is not
+// connected so SIM800L could not be switched on again after AT+CPOWD ), MCU sleeps for MODEM_FAULT_SLEEP
+// and wakes SIM800L up with radio on for next attempt
+void modem_fault(void)
+{
+  at_command(FLIGHTON, AT_TIMEOUT_CFUN);
+  at_command(SLEEPON, AT_TIMEOUT_CMD);
+  sleep_until(millis() + MODEM_FAULT_SLEEP);
+  modemwakeup();
+  at_command(FLIGHTOFF, AT_TIMEOUT_CFUN);
+}
+
+
+// 8 bit pseudo random number, xorshift of 'rnd_state'
+uint8_t random8(void)
+{
+  if (rnd_state == 0)  rnd_state = 1;
+  rnd_state ^= rnd_state << 7;
+  rnd_state ^= rnd_state >> 9;
+  rnd_state ^= rnd_state << 8;
+  return rnd_state >> 8;
+}
+
 // *********************************************************************************************************
-// check if registered to the network
+// check if registered to the network, state comes from +CREG: reports ( AT+CREG=2 ) so SIM800L is asked only
+// when cache is old or nothing was heard for REG_QUERY_TIME. While not registered SIM800L searches for
+// REG_SEARCH_TIME once per call, then radio is turned off and 0 is returned so the caller goes back to its
+// schedule, this is not to drain battery in underground garage. No new search is made before the backoff is
+// over, it doubles after every unsuccessful search up to REG_BACKOFF_MAX and random jitter is added so devices
+// of one site do not search all at the same time after an outage
 // *********************************************************************************************************
+uint8_t reg_backoff(void)
+{
+  return ( reg_waiting && ((int32_t)(reg_retry - millis()) > 0) );
+}
+
 uint8_t checkregistration()
 {
-  uint8_t initialized2;
-     // readline and wait for STATUS NETWORK REGISTRATION from SIM800L
+  uint32_t start, asked;
+
+     if (reg_backoff())  return 0;
+     if (reg_waiting)
+        { // radio was turned off after last unsuccessful search
+          reg_waiting = 0;
+          at_command(FLIGHTOFF, AT_TIMEOUT_CFUN);    // disable airplane mode - turn on radio and start to search for networks
+        };
+     start = millis();
+     asked = start - REG_QUERY_TIME;
      // first 2 networks preferred from SIM list are OK
-                  initialized2 = 0;
-              do { 
-                   delay_sec(3);
-                 // check now if registered
-                   uart_puts_P(SHOW_REGISTRATION);
-                if (readline()>0)
-                   {			   
-                    memcpy_P(buf, ISREG1, sizeof(ISREG1));
-                   if (is_in_rx_buffer(response, buf) == 1)  initialized2 = 1; 
-                    memcpy_P(buf, ISREG2, sizeof(ISREG2));
-                   if (is_in_rx_buffer(response, buf) == 1)  initialized2 = 1; 
-                   }
-                // if not registered or something wrong turn off RADIO for some time (battery) and turn it on again
-                else
-                   {
-                   delay_sec(1);
-                   uart_puts_P(FLIGHTON);    // enable airplane mode - turn off radio for 1 minute
-                   delay_sec(60);                      
-                   uart_puts_P(FLIGHTOFF);   // disable airplane mode - turn on radio and start to search for networks
-                   delay_sec(60);                      
-                 // give reasonable time to search for GSM network - at least 1 minute should be sufficient
-                   };
-                // end of DO loop
-                } while (initialized2 == 0);
+     while (reg_registered() == 0)
+        {
+          // if not registered or no answer from SIM800L for whole search time turn off RADIO
+          // and give up until the backoff is over
+          if ( (millis() - start) >= REG_SEARCH_TIME )
+             {
+               reg_attempts++;
+               at_command(FLIGHTON, AT_TIMEOUT_CFUN);     // enable airplane mode - turn off radio
+               reg_stat = REG_UNKNOWN;
+               reg_retry = millis() + reg_delay + (((reg_delay >> 8) * random8()) >> 2);
+               reg_waiting = 1;
+               if (reg_delay < (REG_BACKOFF_MAX / 2))  reg_delay = reg_delay * 2;
+               else  reg_delay = REG_BACKOFF_MAX;
+               return 0;
+             };
+
+          if ( (millis() - asked) >= REG_QUERY_TIME )
+             { // SIM800L forgets AT+CREG=2 when restarted so reports are enabled with every query
+               asked = millis();
+               at_command(REGISTRATION_REPORT, AT_TIMEOUT_CMD);
+               at_command(SHOW_REGISTRATION, AT_TIMEOUT_CMD);
+               // answer time of SIM800L differs between devices, good enough to seed the jitter
+               rnd_state ^= TCNT0;
+             }
+          // wait for +CREG: report, any line ends the wait and the cache is checked again
+          else  readline_timeout(REG_QUERY_TIME - (millis() - asked));
+
+          reg_elapsed = (millis() - start) / 1000;
+        };
 
-      return initialized2;
+      reg_delay = REG_BACKOFF_MIN;
+      reg_attempts = 0;
+      return 1;
 };
- 
 
 // -------------------------------------------------------------------------------
 // POWER SAVING mode handling to reduce the battery consumption
 // Required connection between SIM800L RI/RING pin and ATMEGA328P INT0/D2 pin
 // -------------------------------------------------------------------------------
 
-void sleepnow(void)
+uint8_t sleepnow(void)
 {
 
-    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    // WDT wakes up MCU every 8 seconds to keep system tick running during sleep
+    if ( (wdt_period_ms == 0) || ((millis() - wdt_calibrated_at) > WDT_CALIBRATION_INTERVAL) )  wdt_calibrate();
 
-    sleep_enable();
+    // USART is stopped in POWER DOWN mode so send everything what is still in TX queue
+    uart_flush_tx();
 
     DDRD &= ~(1 << DDD2);     // Clear the PD2 pin
     // PD2 (PCINT0 pin) is now an input
@@ -531,16 +1808,30 @@ void sleepnow(void)
     // update again INT0 conditions
     EICRA &= ~(1 << ISC01);    // set INT0 to trigger on low level
     EICRA &= ~(1 << ISC00);    // set INT0 to trigger on low level
+    ri_woken = 0;
     EIMSK |= (1 << INT0);      // Turns on INT0 (set bit)
 
     sei();                         //ensure interrupts enabled so we can wake up again
 
-    sleep_cpu();                   //go to sleep
-
-    // MCU ATTMEGA328P sleeps here until INT0 interrupt
-
-    sleep_disable();               //wake up here
-
+    // MCU ATTMEGA328P sleeps here until INT0 interrupt or until periodic report, alarm check or network search is due, WDT wakeups only
+    // advance system tick ( part of WDT period interrupted by INT0 is not counted )
+    while (ri_woken == 0)
+      {
+        if ( (cfg.interval != 0) && ((int32_t)(next_report - millis()) <= 0) )  break;
+        if ( alarm_enabled() && ((int32_t)(next_check - millis()) <= 0) )  break;
+        if ( reg_waiting && (reg_backoff() == 0) )  break;
+        powerdown(WDT_8S, wdt_period_ms);
+      };
+
+    wdt_stop();                    //wake up here
+
+    // woken up for periodic report or alarm check, RI interrupt is not needed any more
+    if (ri_woken == 0)
+      {
+        EIMSK &= ~(1 << INT0);
+        return 0;
+      };
+    return 1;
 }
 
 // when interrupt from INT0 disable next interrupts from RING pin of SIM800L and go back to main code
@@ -548,6 +1839,69 @@ ISR(INT0_vect)
 {
 
    EIMSK &= ~(1 << INT0);          // Turns off INT0 (clear bit)
+   ri_woken = 1;
+}
+
+// measure how long RI stays LOW after wakeup on system tick, MCU stays in IDLE sleep between ticks
+// +CMT: header and text of SMS are longer than RX ring buffer so lines are read ( and SMS queued ) while
+// RI is LOW, reading stops at RING / +CLIP: which are short and are left for the caller
+uint8_t ri_classify(void)
+{
+  uint32_t start;
+
+  start = millis();
+  ri_line = TOK_NONE;
+  while ( !(PIND & (1 << PIND2)) )
+     {
+       if ( (millis() - start) >= RI_CALL_TIME )  return RI_CALL;
+       if ( (rx_head != rx_tail) && (ri_line != TOK_RING) && (ri_line != TOK_CLIP) )
+          { // CR / LF left between lines is dropped here, readline waits only when a line has started
+            if ( (sms_body == SMS_BODY_NONE) && ((rx_ring[rx_tail] == 0x0d) || (rx_ring[rx_tail] == 0x0a)) )  uart_getc();
+            else
+               { readline_timeout(RI_LINE_TIMEOUT);
+                 if ( (line_token == TOK_CMT) || (line_token == TOK_RING) || (line_token == TOK_CLIP) )  ri_line = line_token;
+               };
+          }
+       else
+          { set_sleep_mode(SLEEP_MODE_IDLE);
+            sleep_mode();   // Timer0 interrupt or next char wakes up MCU
+          };
+     };
+  if ( (ri_line == TOK_NONE) && ((millis() - start) < RI_PULSE_MIN) )  return RI_NOISE;
+  return RI_PULSE;
+}
+
+// after wakeup by WDT - periodic report and alarm SMS are queued for the owner number, returns RI_REPORT when
+// there is SMS to send, RI_NOISE when MCU may sleep again ( SIM800L is not woken up for alarm check, only
+// for network search after registration backoff )
+uint8_t timer_event(void)
+{
+  uint8_t event;
+  uint8_t temperature_hi, temperature_lo, humidity_hi, humidity_lo;
+
+  event = RI_NOISE;
+  if ( (cfg.interval != 0) && ((int32_t)(next_report - millis()) <= 0) )
+     {
+       next_report = millis() + (cfg.interval * 60000UL);
+       if (query_put(cfg.owner, QUERY_REPORT))  event = RI_REPORT;
+     };
+  if ( alarm_enabled() && ((int32_t)(next_check - millis()) <= 0) )
+     {
+       next_check = millis() + ALARM_SAMPLE_INTERVAL;
+       dht_start();
+       // DHT 11 calculation like in the reply, change both for DHT 22
+       if ( (dht_wait(&temperature_hi, &temperature_lo, &humidity_hi, &humidity_lo) == DHT_ERR_OK) &&
+            alarm_sample((temperature_hi * 10) + temperature_lo, (humidity_hi * 10) + humidity_lo) &&
+            query_put(cfg.owner, QUERY_ALARM) )  event = RI_REPORT;
+     };
+  // network search again after backoff, SIM800L goes back to SLEEP MODE ( radio stays off when network is not found )
+  if ( reg_waiting && (reg_backoff() == 0) )
+     {
+       modemwakeup();
+       checkregistration();
+       if (cfg.mode == MODE_SLEEP)  at_command(SLEEPON, AT_TIMEOUT_CMD);
+     };
+  return event;
 }
 
 
@@ -563,6 +1917,9 @@ ISR(INT0_vect)
 int main(void) {
 
   uint8_t initialized;                                                 // just a flag within loops
+  uint8_t ri_type;                                                     // what woke MCU up over RI
+  uint8_t query;                                                       // next queued number to reply to
+  uint8_t rssi = 99;                                                   // signal quality for STATUS reply
 
   uint8_t belowzero;                                                   // minus sign of temperature
   uint8_t temperature_hi, temperature_lo, humidity_hi, humidity_lo;    // for temperature and humidity calculation
@@ -570,33 +1927,39 @@ int main(void) {
   uint16_t temperature = 0;
   uint16_t temporary;
  
-  // initialize 9600 baud 8N1 RS232
+  // full 8MHz clock, fuse divides it by 8 after reset
+  clock_prescale_set(clock_div_1);
+
+  // WDT is used only as wakeup source - make sure it does not reset MCU
+  wdt_stop();
+
+  // initialize 9600 baud 8N1 RS232 and 1 ms system tick
   init_uart();
+  init_tick();
 
-  // delay 10 seconds for safe SIM800L startup and network registration
-  delay_sec(10);
+  // DHT data line idle HIGH
+  dht_init();
 
-          
-  // try to communicate with SIM800L over AT
-  initialized = checkat();
-  delay_sec(2);
+  // settings from SMS commands, first periodic report after whole interval
+  config_load();
+  next_report = millis() + (cfg.interval * 60000UL);
+
+  // try to communicate with SIM800L over AT until SIM800L has started up, it is left alone for MODEM_FAULT_SLEEP
+  // after every CHECKAT_ATTEMPTS failed probes
+  while (checkat() == 0)  modem_fault();
 
   // Fix UART speed to 9600 bps to disable autosensing in SIM800L module
-  uart_puts_P(SET9600); 
-  delay_sec(2);
+  at_command(SET9600, AT_TIMEOUT_CMD); 
 
   // configure RI PIN activity for URC ( unsolicited messages like restart of the modem or battery low)
-  uart_puts_P(CFGRIPIN);
-  delay_sec(2);
+  at_command(CFGRIPIN, AT_TIMEOUT_CMD);
 
   // Save settings to SIM800L
-  uart_puts_P(SAVECNF);
-  delay_sec(3);
+  at_command(SAVECNF, AT_TIMEOUT_CMD);
 
   // check pin status, GSM network registration status 
-  checkpin();
+  while (checkpin() == 0)  modem_fault();
   checkregistration();
-  delay_sec(2);
  
      // neverending LOOP
 
@@ -604,64 +1967,102 @@ int main(void) {
 
              do { 
 
-                // delete all SMSes and SMS confirmation to keep SIM800L memory empty   
-                   uart_puts_P(SMS1);
-                   delay_sec(2); 
-                   uart_puts_P(DELSMS);
-                   delay_sec(2);
-                  // configure to display immediately content of SMS
-                   uart_puts_P(SHOWSMS);
-                   delay_sec(2);
+                   at_command(SMS1, AT_TIMEOUT_CMD); 
+                  // configure to display immediately content of SMS ( they were stored in SIM while replying )
+                   at_command(SHOWSMS, AT_TIMEOUT_CMD);
+                  // and number of the caller for query by voice call
+                   at_command(SHOWCALLER, AT_TIMEOUT_CMD);
+                // SMS stored in SIM meanwhile are queued, then read SMSes and SMS confirmation are deleted
+                // to keep SIM800L memory empty
+                   sms_list();
+                   at_command(DELSMS, AT_TIMEOUT_CMGDA);
 
                 // WAIT FOR RING message - incoming voice call and send SMS or restart RADIO module if no signal
                    initialized = 0;
 
                // enter SLEEP MODE of SIM800L for power saving ( will be interrupted by incoming voice call or SMS ) 
-                   uart_puts_P(SLEEPON); 
-                   delay_sec(2);
+               // unless MODE AWAKE was set by SMS command
+                   if (cfg.mode == MODE_SLEEP)  at_command(SLEEPON, AT_TIMEOUT_CMD); 
      
                // enter SLEEP MODE on ATMEGA328P for power saving, INT0 interrupt from RI pin of SIM800L will wake up
-                   sleepnow(); // sleep function called here 
+               // MCU goes back to sleep right away after a glitch on RI ( UART is not read at all ) or after URC which
+               // needs no action ( like +CREG: report which only updates the cache while registered ), SIM800L is not
+               // woken up from its SLEEP MODE then
+                   do {
+                      // responses collected so far are read, queries among them are answered before sleep
+                        readline_drain();
+                        if (query_count > 0)
+                           { ri_type = RI_REPORT;
+                             break;
+                           };
+                        sms_passes = 0;
+                        if (sleepnow() == 0) // sleep function called here 
+                           { // woken up by WDT - back to sleep when alarm check has nothing to report
+                             ri_type = timer_event();
+                             if (ri_type == RI_NOISE)  continue;
+                             break;
+                           };
+                        ri_type = ri_classify();
+                        if (ri_type == RI_NOISE)  continue;
+                      // THERE WAS RI / INT0 INTERRUPT AND SOMETHING WAS SEND OVER SERIAL, READ SERIAL PORT
+                      // unless the line was read already while RI was LOW
+                        if (ri_line == TOK_NONE)
+                           {
+                             readline_timeout(RI_LINE_TIMEOUT);
+                             ri_line = line_token;
+                           };
+                      } while ( (ri_type == RI_NOISE) ||
+                                ((ri_type == RI_PULSE) && (ri_line != TOK_CMT) && (reg_registered() != 0)) );
+
+               // start reading DHT sensor right away, it runs in background while SIM800L is woken up
+                   dht_start();
+
+                   // periodic report or alarm to the owner number or query read before sleep, it is already in the queue
+                    if (ri_type == RI_REPORT)
+                       {
+                         modemwakeup();
+                         initialized = 1;
+                       }
 
-               // THERE WAS RI / INT0 INTERRUPT AND SOMETHING WAS SEND OVER SERIAL 
-               // WE NEED TO GET OFF SLEEPMODE AND READ SERIAL PORT
-                if (readline()>0)
-                   {
                    // check if this is an SMS message first or something else (voice call ?)
-                    memcpy_P(buf, ISSMS, sizeof(ISSMS));  
-                    if  ( is_in_rx_buffer(response, buf) == 1 )  
+                    else if  ( ri_line == TOK_CMT )  
                        { 
-                         // we need to extract phone number from SMS message RESPONSE buffer
-                         readsmsphonenumber(); 
-                         // clear the flags first
-                         initialized = 0;
+                         // phone number of the sender is already in the queue ( readline_timeout ),
+                         // text of SMS follows in next line and may be a command
+                         if (sms_body)  readline_timeout(RI_LINE_TIMEOUT);
                          // disable SLEEPMODE  and proceed with sending SMS                  
-                         uart_puts_P(AT);
-                         delay_sec(1);
-                         uart_puts_P(SLEEPOFF);
-                         delay_sec(1);
+                         modemwakeup();
                         // there was SMS received so we need to set appropriate flag 
-                         initialized = 1;
+                         initialized = (query_count > 0);
                         } // end of IF
 
-                     // if some other message than SMS, ignore it and 
+                     // incoming voice call is a query too - the call is rejected at once so it costs nothing to the
+                     // caller and the reading is sent back by SMS, number of the caller comes in +CLIP: right after RING
+                     else if ( (ri_line == TOK_RING) || (ri_line == TOK_CLIP) )
+                       {
+                         if (ri_line == TOK_RING)  readline_timeout(RI_LINE_TIMEOUT);
+                         initialized = query_add();
+                         // disable SLEEPMODE and hang up
+                         modemwakeup();
+                         at_command(HANGUP, AT_TIMEOUT_CMD);
+                       }
+
+                     // if some other message than SMS or call, ignore it and 
                      // check if network is avaialble and SIM800L is fully operational  
                      else 
                       {
                       // disable SLEEPMODE                  
-                       uart_puts_P(AT);
-                       delay_sec(1);
-                       uart_puts_P(SLEEPOFF);
-                       delay_sec(1);
-                      // check status of all functions 
-                       checkpin();
-                       checkregistration();
-                       delay_sec(1);
+                       modemwakeup();
+                      // check status of all functions, registration is known from +CREG: reports ( they wake up
+                      // the MCU over RI too ) so SIM800L is asked only when it is not registered or was not heard of for long
+                       if (reg_registered() == 0)
+                          {
+                            while (checkpin() == 0)  modem_fault();
+                            checkregistration();
+                          };
                     // there was something different than SMS so we need to go back to the beginning of the loop
                        initialized = 0;
                       }; // end of ELSE
-
-                    }; // END of READLINE IF
                  
                 } while ( initialized == 0);    // end od DO-WHILE, go to begging and enter SLEEPMODE again 
 
@@ -669,22 +2070,9 @@ int main(void) {
            if (initialized == 1)
            {
 
-               // initialize DHT22 temperature & humidity sensor, we will get reading after 4 seconds
-               dht_init();
-               delay_sec(2);
-
-               // send SMS preamble
-               uart_puts_P(SMS1);
-               delay_sec(1); 
-               // compose an SMS from fragments - interactive mode CTRL Z at the end
-               uart_puts_P(SMS2);
-               uart_puts(phonenumber);  // send phone number received from SMS
-               uart_puts_P(CRLF);   			   
-               delay_sec(1); 
-
-               // read value from DHT22/DHT11 sensor, humidity amd temperature are encoded on 16 bits each
-               dht_read(&temperature_hi, &temperature_lo,  &humidity_hi, &humidity_lo);
- 
+               // get value from DHT22/DHT11 sensor read in background since wakeup, humidity amd temperature are encoded on 16 bits each
+               dht_wait(&temperature_hi, &temperature_lo,  &humidity_hi, &humidity_lo);
+
                // enable proper code block for DHT11 or DHT22
 
                // DHT 11 code :
@@ -713,38 +2101,110 @@ int main(void) {
                      humidity = ( humidity_hi * 256 ) + humidity_lo;
                */
 
+               // send SMS preamble, new SMS are stored in SIM until the reply is over so none is lost when
+               // the queue is full
+               at_command(SMS1, AT_TIMEOUT_CMD); 
+               at_command(STORESMS, AT_TIMEOUT_CMD);
+
+               // reply with the same reading to every queued number, queries coming meanwhile are queued too,
+               // then SMS which were stored in SIM are listed ( and queued ) in next pass with empty queue,
+               // passes go on until no SMS is left unread
+               do {
+                    query = 0;
+                    while (query < query_count)
+                      {
+                      // SMS command of this sender changes settings before the reply
+                       query_apply(query);
+                      // periodic report is not sent when temperature has not changed enough since last one
+                       if ( (query_kind[query] == QUERY_REPORT) && report_sent && (cfg.threshold != 0) &&
+                            ( ((temperature > report_temperature) ? (temperature - report_temperature)
+                                                                  : (report_temperature - temperature)) < cfg.threshold ) )
+                          { query++;
+                            continue;
+                          };
+                       if (query_kind[query] == QUERY_STATUS)  rssi = read_rssi();
+
+                      // compose an SMS from fragments - interactive mode CTRL Z at the end
+                       readline_drain();
+                       uart_puts_P(SMS2);
+                       uart_puts((const char *)query_numbers[query]);  // send phone number received from SMS or call
+                       uart_puts_P(CRLF);   			   
+                       at_wait_prompt(AT_TIMEOUT_CMD);   // wait for '>' prompt of SMS text input
+
+                      // settings and network diagnostics go first in reply to a command
+                       if (query_kind[query] == QUERY_STATUS)
+                          {
+                            uart_puts_P(STATUSSMS1);
+                            uart_puts(format_uint(cfg.interval));
+                            uart_puts_P(STATUSSMS2);
+                            send_tenths(cfg.threshold);
+                            uart_puts_P(STATUSSMS3);
+                            uart_puts_P( (cfg.mode == MODE_AWAKE) ? MODE_AWAKE_TXT : MODE_SLEEP_TXT );
+                            uart_puts_P(STATUSSMS4);
+                            uart_puts(format_uint(rssi));
+                            uart_puts_P(STATUSSMS5);
+                            uart_puts(format_uint(reg_lac));
+                            uart_puts_P(STATUSSMS6);
+                            uart_puts(format_uint(reg_ci));
+                            uart_puts_P(STATUSSMS7);
+                            uart_puts(format_uint(reg_attempts));
+                            uart_puts_P(STATUSSMS8);
+                            send_tenths(cfg.low[ALARM_TEMPERATURE]);
+                            send_uart(47);   // the SLASH character, bounds may be below zero
+                            send_tenths(cfg.high[ALARM_TEMPERATURE]);
+                            uart_puts_P(STATUSSMS9);
+                            send_tenths(cfg.low[ALARM_HUMIDITY]);
+                            send_uart(47);   // the SLASH character
+                            send_tenths(cfg.high[ALARM_HUMIDITY]);
+                          };
+
+                      // alarm state of both channels
+                       if (query_kind[query] >= QUERY_ALARM)
+                          {
+                            uart_puts_P(ALARMSMS1);
+                            send_alarm_state(ALARM_TEMPERATURE);
+                            uart_puts_P(ALARMSMS2);
+                            send_alarm_state(ALARM_HUMIDITY);
+                          };
+
+                       // calculate 3 digits for temperature and send it 
+                       uart_puts_P(TEMPERATURESMS); // send info
+                       dhttxt[0] = belowzero;
+                       dhttxt[1] = (temperature / 100) + 48;  // calculate ASCII code for digits
+                       temporary = temperature % 100; 
+                       dhttxt[2] = (temporary / 10) + 48;
+                       dhttxt[3] = 46 ;  // the DOT character
+                       dhttxt[4] = (temporary % 10) + 48; 
+
+                       uart_puts((const char *)dhttxt);   // send DHT22 temperature readings
+
+                       // calculate 3 digits for humidity and send it
+                       uart_puts_P(HUMIDITYSMS); // send info
+                       dhttxt[0] = 32;  // empty 'space'
+                       dhttxt[1] = (humidity / 100) + 48;
+                       temporary = humidity % 100; 
+                       dhttxt[2] = (temporary / 10) + 48;
+                       dhttxt[3] = 46 ;   // the DOT character
+                       dhttxt[4] = (temporary % 10) + 48; 
+
+                       uart_puts((const char *)dhttxt);   // send DHT22 temperature readings
+
+                      // send SMS end sequence and wait until SMS is sent
+                       send_uart(26);   // ctrl Z to end SMS
+                       at_wait(TOK_NONE, AT_TIMEOUT_CMGS);
+                       if (query_kind[query] == QUERY_REPORT)
+                          { report_temperature = temperature;
+                            report_sent = 1;
+                          };
+                       query++;
+                      };
+                    query_count = 0;
+                  } while (sms_list() > 0);
 
-	      // calculate 3 digits for temperature and send it 
-              uart_puts_P(TEMPERATURESMS); // send info
-              dhttxt[0] = belowzero;
-              dhttxt[1] = (temperature / 100) + 48;  // calculate ASCII code for digits
-              temporary = temperature % 100; 
-              dhttxt[2] = (temporary / 10) + 48;
-              dhttxt[3] = 46 ;  // the DOT character
-              dhttxt[4] = (temporary % 10) + 48; 
-
-              uart_puts(dhttxt);   // send DHT22 temperature readings
-
-              // calculate 3 digits for humidity and send it
-              uart_puts_P(HUMIDITYSMS); // send info
-              dhttxt[0] = 32;  // empty 'space'
-              dhttxt[1] = (humidity / 100) + 48;
-              temporary = humidity % 100; 
-              dhttxt[2] = (temporary / 10) + 48;
-              dhttxt[3] = 46 ;   // the DOT character
-              dhttxt[4] = (temporary % 10) + 48; 
-
-              uart_puts(dhttxt);   // send DHT22 temperature readings
-
-              // send SMS end sequence
-              delay_sec(1); 
-              send_uart(26);   // ctrl Z to end SMS
               initialized = 0;
 		   
           } /// end of SMS response procedure
 
-       
-        delay_sec(5);
         // go to the beginning and enter sleepmode on SIM800L and ATMEGA328P again for power saving
 
         // end of neverending loop
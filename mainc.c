@@ -1,7 +1,11 @@
 /* ---------------------------------------------------------------------------
  * IOT device based on ATMEGA328P + SIM800L + DHT22
  * will send temperature and humidity reading over GPRS to thingspeak platform
- * readings every N minutes configurable
+ * readings every N minutes configurable (here 10 minutes) are stored in EEPROM
+ * and uploaded together as one bulk update only when temperature or humidity
+ * changed by more than set dead band, or at least every M minutes (here 120 minutes)
+ * crossing of alarm bounds of temperature or humidity is uploaded right away
+ * Please put correct Thingspeak API KEY and CHANNEL ID
  * by Adam Loboda - adam.loboda@wp.pl
  * baudrate for SIM800L communication is 9600 bps
  * please configure SIM800L to fixed 9600 first by AT+IPR=9600 command 
@@ -10,6 +14,8 @@
  * in this version SIM800L radio is NOT switched OFF
  * instead only SIM800L SLEEP MODE is used to 
  * conserve battery power
+ * GPRS bearer and HTTP service are also kept open
+ * between uploads and rebuilt only when they fail
  * ---------------------------------------------------------------------------
  */
 
@@ -23,15 +29,19 @@
 #include <avr/wdt.h>
 #include <string.h>
 #include <avr/power.h>
+#include <util/atomic.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
 
 #define UART_NO_DATA 0x0100
-// internal RC oscillator 8MHz with divison by 8 and U2X0 = 1, gives 0.2% error rate for 9600 bps UART speed
-// and lower current consumption
-// for 1MHz : -U lfuse:w:0x62:m     on ATMEGA328P
-#define F_CPU 1000000UL
+// internal RC oscillator 8MHz is divided by 8 after reset ( -U lfuse:w:0x62:m on ATMEGA328P ), main() switches
+// the division off - bit 0 of DHT frame lasts only ~ 76us and its capture interrupt must not be late behind
+// UART and tick interrupts, at 1MHz it would have ~ 76 cycles for that. MCU sleeps in POWER DOWN most of
+// the time so the higher clock costs little. U2X0 = 1 gives 0.2% error rate for 9600 bps UART speed
+#define F_CPU 8000000UL
 
 #define BAUD 9600
-// formula for 1MHz clock and U2X0 = 1 double UART speed 
+// formula for U2X0 = 1 double UART speed 
 #define MYUBBR ((F_CPU / (BAUD * 8L)) - 1)
 
 
@@ -41,25 +51,189 @@
 
 #define DHT_ERR_OK         (0)
 #define DHT_ERR_TIMEOUT    (-1)
+#define DHT_ERR_CHECKSUM   (-2)
 
 #define DHT_PIN_INPUT()    (DDRB &= ~_BV(DHT_PIN))
 #define DHT_PIN_OUTPUT()   (DDRB |= _BV(DHT_PIN))
 #define DHT_PIN_LOW()      (PORTB &= ~_BV(DHT_PIN))
 #define DHT_PIN_HIGH()     (PORTB |= _BV(DHT_PIN))
 #define DHT_PIN_READ()     (PINB & _BV(DHT_PIN))
-#define DHT_TIMEOUT        (80)
+#define DHT_EDGES          (42)    // falling edges in frame - response, then 40 bits
+#define DHT_BIT_THRESHOLD  (100)   // us between falling edges, bit 0 takes ~ 76us, bit 1 ~ 120us
+#define DHT_START_PULSE    (20000) // us of LOW start pulse, ended by Timer1 compare match
+#define DHT_JOB_TIMEOUT    (30UL)  // ms for start pulse and whole frame, frame takes ~ 5ms
+#define DHT_BUSY           (1)     // reading still in progress
+
+// Timer1 counts microseconds for DHT input capture - prescaler 1 for 1MHz clock, 8 for 8MHz clock
+#if F_CPU > 2000000UL
+#define DHT_T1_PRESCALER   (1<<CS11)
+#else
+#define DHT_T1_PRESCALER   (1<<CS10)
+#endif
+
+// Timer0 generates 1 ms system tick - prescaler 8 for 1MHz clock, 64 for 8MHz clock
+#if F_CPU > 2000000UL
+#define TICK_PRESCALER     ((1<<CS01)|(1<<CS00))
+#define TICK_OCR           ((F_CPU / 64 / 1000) - 1)
+#else
+#define TICK_PRESCALER     (1<<CS01)
+#define TICK_OCR           ((F_CPU / 8 / 1000) - 1)
+#endif
+
+// WDT prescaler bits for 8 s and 1 s periods ( 1024K and 128K cycles of 128kHz oscillator )
+#define WDT_8S             ((1<<WDP3)|(1<<WDP0))
+#define WDT_1S             ((1<<WDP2)|(1<<WDP1))
+#define WDT_CALIBRATION_INTERVAL  (3600000UL)   // measure WDT oscillator again after 1 hour
+
+// network registration backoff - search time with radio on, then no search with radio off for a time growing
+// twice from REG_BACKOFF_MIN to REG_BACKOFF_MAX ( milliseconds ) plus random jitter of up to 1/4 of the time
+#define REG_SEARCH_TIME    (60000UL)
+#define REG_BACKOFF_MIN    (60000UL)
+#define REG_BACKOFF_MAX    (3600000UL)
+
+// cached registration state from +CREG: reports, AT+CREG? is sent only when nothing was heard for
+// REG_QUERY_TIME while waiting, cache older than REG_CACHE_TIME is not trusted
+#define REG_UNKNOWN        (0xFF)
+#define REG_QUERY_TIME     (20000UL)
+#define REG_CACHE_TIME     (1800000UL)
+
+// readline_timeout() results
+#define READLINE_TIMEOUT   (0)
+#define READLINE_OK        (1)
+
+// AT command engine results and timeouts ( milliseconds ) 
+#define AT_OK              (0)
+#define AT_ERROR           (1)
+#define AT_TIMEOUT         (2)
+
+// line tokens recognised by streaming parser, numbers must match order of AT_TOKENS table
+#define TOK_NONE           (0)
+#define TOK_OK             (1)
+#define TOK_ERROR          (2)
+#define TOK_CME_ERROR      (3)
+#define TOK_CMS_ERROR      (4)
+#define TOK_CREG           (5)
+#define TOK_CPIN           (6)
+#define TOK_SAPBR          (7)
+#define TOK_HTTPACTION     (8)
+#define TOK_CSQ            (9)
+#define TOK_CCLK           (10)
+#define TOK_DOWNLOAD       (11)
+#define TOK_SHUT           (12)
+#define TOK_CONNECT        (13)
+#define TOK_SEND           (14)
+#define TOK_CLOSE          (15)
+#define AT_TOKENS_COUNT    (15)      // at most 16 tokens, one bit each in tok_match
+
+#define AT_TIMEOUT_PROBE   (1000UL)     // AT when modem may be still asleep
+#define AT_TIMEOUT_CMD     (5000UL)     // ordinary configuration command
+#define AT_TIMEOUT_CFUN    (10000UL)    // switching radio on/off
+#define AT_TIMEOUT_CPIN    (5000UL)     // +CPIN: report of SIM card after start or after entering PIN
+#define AT_TIMEOUT_SAPBR   (85000UL)    // GPRS attach and opening / closing IP bearer
+#define AT_TIMEOUT_HTTP    (120000UL)   // +HTTPACTION: response from the server
+#define AT_TIMEOUT_CIP     (75000UL)    // opening connection, sending data, deactivating TCP/IP stack
+#define AT_TIMEOUT_ACK     (10000UL)    // acknowledge byte from the server
+#define RX_DRAIN_TIMEOUT   (500UL)      // rest of a line already started when RX ring is drained
+#define CHECKAT_ATTEMPTS   (30)         // AT probes before SIM800L is taken as dead
+#define CHECKPIN_ATTEMPTS  (10)         // AT+CPIN? polls before SIM card is taken as missing or locked
+
+// DHT is sampled every 10 minutes into EEPROM log, log is uploaded in one GPRS connection when the sample
+// left the dead band around the last uploaded one, flat readings are uploaded every 120 minutes as heartbeat
+#define SAMPLE_INTERVAL    (10UL * 60UL * 1000UL)
+#define HEARTBEAT_INTERVAL (120UL * 60UL * 1000UL)
+#define UPLOAD_RETRY       (30UL * 60UL * 1000UL)   // next attempt after failed upload, dead band is not checked before
+#define DELTA_TEMPERATURE  (5)          // 0.5 C - dead band in tenths of unit, 0 uploads every sample
+#define DELTA_HUMIDITY     (20)         // 2.0 %RH
+
+// alarm engine - state of every channel is changed after ALARM_DEBOUNCE samples in a row which want it, raised alarm
+// is cleared only inside the bounds narrowed by hysteresis, every change is uploaded at once regardless of dead band
+#define ALARM_TEMPERATURE  (0)          // channels
+#define ALARM_HUMIDITY     (1)
+#define ALARM_CHANNELS     (2)
+#define ALARM_NONE         (0)          // channel states
+#define ALARM_LOW          (1)
+#define ALARM_HIGH         (2)
+#define ALARM_DEBOUNCE     (2)
+#define TEMPERATURE_LOW    (30)         // 3.0 C - bounds and hysteresis in tenths of unit
+#define TEMPERATURE_HIGH   (300)        // 30.0 C
+#define TEMPERATURE_HYST   (10)         // 1.0 C
+#define HUMIDITY_LOW       (200)        // 20.0 %RH
+#define HUMIDITY_HIGH      (800)        // 80.0 %RH
+#define HUMIDITY_HYST      (30)         // 3.0 %RH
+#define UPLOAD_MAX         (24)         // samples in one MQTT message or binary frame ( fits one AT+CIPSEND )
+#define HTTP_UPLOAD_MAX    (96)         // samples in one Thingspeak bulk update, ~ 5 KB of body takes ~ 5 s at 9600 bps
+#define HTTP_UPLOAD_SPACING (15000UL)   // Thingspeak accepts next bulk update only 15 s after previous one
+#define HTTP_READ_REPLY    (0)          // 1 - read reply of the server with AT+HTTPREAD ( to see it on serial line )
+
+// uplink of samples - Thingspeak bulk update over HTTP, binary frame to own server over UDP or TCP,
+// or MQTT 3.1.1 publish to own broker
+#define UPLINK_HTTP        (0)
+#define UPLINK_UDP         (1)
+#define UPLINK_TCP         (2)
+#define UPLINK_MQTT        (3)
+#define UPLINK             (UPLINK_HTTP)
+#define DEVICE_ID          (1)          // identifies the device in binary frame and MQTT message
+#define FRAME_VERSION      (2)
+#define FRAME_ACK          (0x06)       // byte the server answers with in TCP mode
+#define MQTT_QOS           (1)          // 0 - delivered when broker accepts connection, 1 - when PUBACK comes
+#define MQTT_KEEPALIVE     (60)         // seconds, connection lasts for one publish only
+
+// MQTT control packet types
+#define MQTT_CONNECT       (0x10)
+#define MQTT_CONNACK       (0x20)
+#define MQTT_PUBLISH       (0x30)
+#define MQTT_PUBACK        (0x40)
+#define MQTT_DISCONNECT    (0xE0)
+
+// EEPROM sample log - blocks of absolute sample and 4 bit deltas, 15 bit sequence number of first sample,
+// erased cells read as LOG_SEQ_EMPTY
+#define LOG_BLOCK_SIZE     (32)
+#define LOG_HEADER_SIZE    (6)
+#define LOG_BLOCK_DELTAS   (LOG_BLOCK_SIZE - LOG_HEADER_SIZE)
+#define LOG_BLOCK_SAMPLES  (LOG_BLOCK_DELTAS + 1)
+#define LOG_RESERVED       (32)         // end of EEPROM is kept for persistent settings
+#define LOG_BLOCKS         ((E2END + 1 - LOG_RESERVED) / LOG_BLOCK_SIZE)
+#define LOG_SENT_ADDR      ((uint16_t *)(E2END + 1 - LOG_RESERVED))   // ring of slots with first sample not accepted
+#define LOG_SENT_SLOTS     (LOG_RESERVED / 2)                           // by server yet, next slot is written every time
+#define LOG_SEQ_MASK       (0x7FFF)
+#define LOG_SEQ_EMPTY      (0xFFFF)
+#define LOG_GAP            (0xF0)       // delta of sample period without reading ( DHT failed or sample was late ),
+                                        // the last sample stays base of next delta
+#define LOG_HUM_GAP        (0x8000)     // flags in humidity of block header - first sample is LOG_GAP,
+#define LOG_HUM_RESTART    (0x4000)     // first sample after restart ( time since previous one is not known )
+#define LOG_HUM_FLAGS      (LOG_HUM_GAP | LOG_HUM_RESTART)
 
 // static text needed for SIM800L conversation
 
 const char AT[] PROGMEM = { "AT\n\r" }; // wakeup from sleep mode
 const char ISOK[] PROGMEM = { "OK" };
-const char ISREG1[] PROGMEM = { "+CREG: 0,1" };  // registered in HPLMN
-const char ISREG2[] PROGMEM = { "+CREG: 0,5" };  // registered in ROAMING NETWORK
+const char ISERROR[] PROGMEM = { "ERROR" };
+const char ISCMEERROR[] PROGMEM = { "+CME ERROR" };
+const char ISCMSERROR[] PROGMEM = { "+CMS ERROR" };
+const char ISCREG[] PROGMEM = { "+CREG:" };
+const char ISCPIN[] PROGMEM = { "+CPIN:" };
+const char ISSAPBR[] PROGMEM = { "+SAPBR:" };              // IP bearer status
+const char ISHTTPACTION[] PROGMEM = { "+HTTPACTION:" };    // result of HTTP request from the server
+const char ISCSQ[] PROGMEM = { "+CSQ:" };                  // signal quality
+const char ISCCLK[] PROGMEM = { "+CCLK:" };                // network clock
+const char ISDOWNLOAD[] PROGMEM = { "DOWNLOAD" };           // AT+HTTPDATA waits for the body
+const char ISSHUT[] PROGMEM = { "SHUT OK" };                // TCP/IP stack deactivated
+const char ISCONNECT[] PROGMEM = { "CONNECT" };             // CONNECT OK / CONNECT FAIL after AT+CIPSTART
+const char ISSEND[] PROGMEM = { "SEND" };                   // SEND OK / SEND FAIL after AT+CIPSEND
+const char ISCLOSE[] PROGMEM = { "CLOSE OK" };              // connection closed
+
+// token table for streaming parser of SIM800L responses
+const char * const AT_TOKENS[AT_TOKENS_COUNT] PROGMEM = { ISOK, ISERROR, ISCMEERROR, ISCMSERROR, ISCREG, ISCPIN,
+                                                         ISSAPBR, ISHTTPACTION, ISCSQ, ISCCLK, ISDOWNLOAD,
+                                                         ISSHUT, ISCONNECT, ISSEND, ISCLOSE };
 const char SHOW_REGISTRATION[] PROGMEM = {"AT+CREG?\n\r"};
-const char PIN_IS_READY[] PROGMEM = {"+CPIN: READY"};
-const char PIN_MUST_BE_ENTERED[] PROGMEM = {"+CPIN: SIM PIN"};
+const char REGISTRATION_REPORT[] PROGMEM = { "AT+CREG=2\r\n" };   // +CREG: <stat>,<lac>,<ci> on every change
+const char PIN_IS_READY[] PROGMEM = {"READY"};              // +CPIN: READY
+const char PIN_MUST_BE_ENTERED[] PROGMEM = {"SIM PIN"};      // +CPIN: SIM PIN
 
 const char SHOW_PIN[] PROGMEM = {"AT+CPIN?\n\r"};
+const char SHOW_CSQ[] PROGMEM = {"AT+CSQ\r\n"};               // +CSQ: <rssi>,<ber>
+const char SHOW_CLOCK[] PROGMEM = {"AT+CCLK?\r\n"};           // +CCLK: "yy/MM/dd,hh:mm:ss+zz"
 const char ECHO_OFF[] PROGMEM = {"ATE0\n\r"};
 const char ENTER_PIN[] PROGMEM = {"AT+CPIN=\"1111\"\n\r"};
 
@@ -74,7 +248,6 @@ const char SAPBR4[] PROGMEM = {"AT+SAPBR=3,1,\"PWD\",\"<MyPassword>\"\r\n"};
 const char SAPBROPEN[] PROGMEM = {"AT+SAPBR=1,1\r\n"};      // open IP bearer
 const char SAPBRQUERY[] PROGMEM = {"AT+SAPBR=2,1\r\n"};     // query IP bearer
 const char SAPBRCLOSE[] PROGMEM = {"AT+SAPBR=0,1\r\n"};     // close bearer 
-const char SAPBRSUCC[] PROGMEM = {"+SAPBR: 1,1"};           // bearer was succesfull we are not checking IP assigned
 
 // Flightmode ON OFF - for network searching
 const char FLIGHTON[] PROGMEM = { "AT+CFUN=4\r\n" };
@@ -87,6 +260,9 @@ const char SLEEPOFF[] PROGMEM = { "AT+CSCLK=0\r\n" };
 // Fix UART speed to 9600 bps
 const char SET9600[] PROGMEM = { "AT+IPR=9600\r\n" };
 
+// Network time to SIM800L clock ( time of binary frame and MQTT message ), saved with AT&W
+const char CLOCKSYNC[] PROGMEM = { "AT+CLTS=1\r\n" };
+
 // Save settings to SIM800L
 const char SAVECNF[] PROGMEM = { "AT&W\r\n" };
 
@@ -95,14 +271,75 @@ const char DISABLELED[] PROGMEM = { "AT+CNETLIGHT=0\r\n" };
 
 // HTTP communication with Thingspeak 
 const char HTTPAPIKEY[] PROGMEM = { "XXXXXXXXXXXXXXX" };   // Put your THINGSPEAK API KEY HERE !!!
+const char HTTPCHANNEL[] PROGMEM = { "XXXXXX" };           // Put your THINGSPEAK CHANNEL ID HERE !!!
 const char HTTPINIT[] PROGMEM = { "AT+HTTPINIT\r\n" };
 const char HTTPPARA[] PROGMEM = { "AT+HTTPPARA=\"CID\",1\r\n" };
-const char HTTPTSPK1[] PROGMEM = { "AT+HTTPPARA=\"URL\",\"http://" };
-const char HTTPTSPK2[] PROGMEM = { "api.thingspeak.com/update?api_key=" };
-const char HTTPTSPK3[] PROGMEM = { "&field1=" };
-const char HTTPTSPK4[] PROGMEM = { "&field2=" };
-const char HTTPTSPK5[] PROGMEM = { "\"\n\r" };
-const char HTTPACTION[] PROGMEM = { "AT+HTTPACTION=0\r\n" };
+const char HTTPTSPK1[] PROGMEM = { "AT+HTTPPARA=\"URL\",\"http://api.thingspeak.com/channels/" };
+const char HTTPTSPK2[] PROGMEM = { "/bulk_update.json\"\r\n" };
+const char HTTPCONTENT[] PROGMEM = { "AT+HTTPPARA=\"CONTENT\",\"application/json\"\r\n" };
+const char HTTPDATA1[] PROGMEM = { "AT+HTTPDATA=" };
+const char HTTPDATA2[] PROGMEM = { ",30000\r\n" };         // body length, max time to send it in ms
+const char HTTPACTION[] PROGMEM = { "AT+HTTPACTION=1\r\n" };  // POST
+const char HTTPREAD[] PROGMEM = { "AT+HTTPREAD\r\n" };
+const char HTTPTERM[] PROGMEM = { "AT+HTTPTERM\r\n" };
+
+// own server for binary frame or MQTT broker, host and port
+const char SERVER_HOST[] PROGMEM = { "example.com" };      // Put your SERVER ADDRESS HERE !!!
+#if UPLINK == UPLINK_MQTT
+const char SERVER_PORT[] PROGMEM = { "1883" };             // Put your BROKER PORT HERE !!!
+#else
+const char SERVER_PORT[] PROGMEM = { "5000" };             // Put your SERVER PORT HERE !!!
+#endif
+
+// MQTT client, empty MQTT_USER means no user name and password in CONNECT
+const char MQTT_PROTOCOL[] PROGMEM = { "MQTT" };
+const char MQTT_CLIENT[] PROGMEM = { "smartmeter1" };      // Put your CLIENT ID HERE !!!
+const char MQTT_USER[] PROGMEM = { "" };                   // Put your BROKER USER HERE !!!
+const char MQTT_PASSWORD[] PROGMEM = { "" };               // Put your BROKER PASSWORD HERE !!!
+const char MQTT_TOPIC[] PROGMEM = { "smartmetering/1/samples" };
+
+// SIM800L TCP/IP stack for binary frame and MQTT, APN same as in SAPBR2..4
+const char CIPSHUT[] PROGMEM = { "AT+CIPSHUT\r\n" };
+const char CIPHEAD[] PROGMEM = { "AT+CIPHEAD=1\r\n" };     // show received data as +IPD,<length>:<data>
+const char CSTT[] PROGMEM = { "AT+CSTT=\"internet\",\"\",\"\"\r\n" };   // Put your APN, USERNAME, PASSWORD here
+const char CIICR[] PROGMEM = { "AT+CIICR\r\n" };
+const char CIFSR[] PROGMEM = { "AT+CIFSR\r\n" };
+#if (UPLINK == UPLINK_TCP) || (UPLINK == UPLINK_MQTT)
+const char CIPSTART1[] PROGMEM = { "AT+CIPSTART=\"TCP\",\"" };
+#else
+const char CIPSTART1[] PROGMEM = { "AT+CIPSTART=\"UDP\",\"" };
+#endif
+const char CIPSTART2[] PROGMEM = { "\",\"" };
+const char CIPSTART3[] PROGMEM = { "\"\r\n" };
+const char CIPSEND[] PROGMEM = { "AT+CIPSEND=" };
+const char CIPSEND2[] PROGMEM = { "\r\n" };
+const char CIPCLOSE[] PROGMEM = { "AT+CIPCLOSE\r\n" };
+const char ISIPD[] PROGMEM = { "+IPD," };
+
+// days in the year before first day of the month
+const uint16_t DAYS_BEFORE_MONTH[12] PROGMEM = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+
+// JSON message of MQTT publish
+const char MQTTJSON1[] PROGMEM = { "{\"device\":" };
+const char MQTTJSON2[] PROGMEM = { ",\"seq\":" };
+const char MQTTJSON3[] PROGMEM = { ",\"time\":" };
+const char MQTTJSON4[] PROGMEM = { ",\"interval\":" };
+const char MQTTJSON5[] PROGMEM = { ",\"samples\":[" };
+const char MQTTJSON6[] PROGMEM = { "]}" };
+const char MQTTJSON7[] PROGMEM = { ",\"lac\":" };
+const char MQTTJSON8[] PROGMEM = { ",\"ci\":" };
+const char MQTTJSON9[] PROGMEM = { ",\"restart\":1" };
+const char MQTTJSON10[] PROGMEM = { "null" };
+
+// JSON body of Thingspeak bulk update
+const char JSON1[] PROGMEM = { "{\"write_api_key\":\"" };
+const char JSON2[] PROGMEM = { "\",\"updates\":[" };
+const char JSON3[] PROGMEM = { "," };
+const char JSON4[] PROGMEM = { "{\"delta_t\":" };
+const char JSON5[] PROGMEM = { ",\"field1\":\"" };
+const char JSON6[] PROGMEM = { "\",\"field2\":\"" };
+const char JSON7[] PROGMEM = { "\"}" };
+const char JSON8[] PROGMEM = { "]}" };
 
 
 #define BUFFER_SIZE 40
@@ -110,166 +347,310 @@ const char HTTPACTION[] PROGMEM = { "AT+HTTPACTION=0\r\n" };
 volatile static uint8_t response[BUFFER_SIZE] = "1234567890123456789012345678901234567890";
 volatile static uint8_t response_pos = 0;
 volatile static uint8_t dhttxt[6] = "00000\x00";
-volatile static uint8_t buf[20];  // buffer to copy string from PROGMEM
-
 
-// -------------------------------------------------------------------------------------------------------
-// ---------------------------------------- DHT22  library CODE ------------------------------------------
-// -------------------------------------------------------------------------------------------------------
+// DHT frame received by Timer1 input capture interrupt
+volatile static uint8_t dht_times[DHT_EDGES];   // low byte of ICR1 at every falling edge
+volatile static uint8_t dht_edges = 0;
+static uint8_t dht_data[5];
+static uint32_t dht_started = 0;
+static int8_t dht_result = DHT_ERR_TIMEOUT;
+
+// EEPROM log position - newest block, samples in it and the last one, sequence number for next sample,
+// first sample not uploaded yet
+static uint8_t log_head = 0;
+static uint8_t log_count = 0;
+static int16_t log_temp = 0;
+static uint16_t log_hum = 0;
+static uint16_t log_seq = 0;
+static uint16_t log_sent = 0;
+static uint8_t log_sent_slot = 0;
+static uint8_t log_restart = 0;
+
+// send-on-delta - last sample accepted by server, upload_hold is set after failed upload
+static int16_t sent_temp = 0;
+static uint16_t sent_hum = 0;
+static uint8_t sent_valid = 0;
+static uint8_t upload_hold = 0;
+
+// alarm engine - state of every channel and number of samples in a row which want to change it
+static uint8_t alarm_state[ALARM_CHANNELS];
+static uint8_t alarm_count[ALARM_CHANNELS];
+
+// EEPROM log decoder position - block, delta within it and decoded sample, gap keeps the previous values
+static uint8_t dec_block = 0;
+static uint8_t dec_pos = 0;
+static int16_t dec_temp = 0;
+static uint16_t dec_hum = 0;
+static uint8_t dec_gap = 0;
+static uint8_t dec_restart = 0;
+
+// HTTP body, frame and MQTT packets are counted first and then sent, decimal numbers are formatted in 'numtxt'
+static uint16_t out_len = 0;
+static uint8_t out_send = 0;
+static uint8_t numtxt[11];
+#if UPLINK == UPLINK_HTTP
+static uint32_t http_posted = 0;       // system tick of last bulk update
+#endif
+
+#if UPLINK != UPLINK_HTTP
+// binary frame CRC, time of frame and MQTT message, bytes of +IPD data block still to come
+static uint16_t out_crc = 0;
+static uint32_t frame_time = 0;
+static uint16_t ipd_left = 0;
+#endif
+
+// HTTP service is initialised and kept between uploads
+static uint8_t http_ready = 0;
+
+// streaming parser state - tokens still matching current line, recognised token and its arguments offset
+static uint16_t tok_match = 0;
+static uint8_t line_token = TOK_NONE;
+static uint8_t line_arg = 0;
+
+// arguments of recognised line split into comma separated fields - offset and length in 'response'
+// quotes around a field are not part of it, commas inside quotes do not split
+#define AT_MAX_FIELDS      (8)
+#define FLD_NEW            (0)   // next char begins a field
+#define FLD_PLAIN          (1)   // inside unquoted field
+#define FLD_QUOTED         (2)   // inside quoted field
+#define FLD_CLOSED         (3)   // after closing quote, waiting for comma
+#define FLD_FULL           (4)   // no room for more fields
+static uint8_t field_off[AT_MAX_FIELDS];
+static uint8_t field_len[AT_MAX_FIELDS];
+static uint8_t field_count = 0;
+static uint8_t field_state = FLD_NEW;
+
+// UART receive ring buffer filled by USART RX interrupt, size must be power of two
+// rx_head is written only by the ISR, rx_tail only by the main code - no locking needed
+#define RX_RING_SIZE 64
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+volatile static uint8_t rx_ring[RX_RING_SIZE];
+volatile static uint8_t rx_head = 0;
+volatile static uint8_t rx_tail = 0;
+
+// UART transmit queue drained by USART data register empty interrupt
+// each entry is a pointer to PROGMEM string or a single char ( tx_pgm = NULL ), texts are not copied to RAM
+// tx_head is written only by the main code, tx_tail only by the ISR
+#define TX_QUEUE_SIZE 16
+#define TX_QUEUE_MASK (TX_QUEUE_SIZE - 1)
+static const char * volatile tx_pgm[TX_QUEUE_SIZE];
+volatile static uint8_t tx_char[TX_QUEUE_SIZE];
+volatile static uint8_t tx_head = 0;
+volatile static uint8_t tx_tail = 0;
+volatile static uint8_t tx_sent = 0;   // set when some char was written to UDR0 since last flush
+
+// milliseconds since power on, incremented by Timer0 compare interrupt
+volatile static uint32_t ticks_ms = 0;
+
+// watchdog sleep service - measured length of 8 s WDT period and milliseconds added by WDT interrupt
+volatile static uint16_t wdt_period_ms = 0;
+volatile static uint16_t wdt_add_ms = 0;
+volatile static uint8_t wdt_fired = 0;
+static uint32_t wdt_calibrated_at = 0;
+
+// registration diagnostics - unsuccessful searches in a row and seconds spent in the last ( or ongoing ) search
+static uint16_t reg_attempts = 0;
+static uint32_t reg_elapsed = 0;
+static uint16_t rnd_state = 1;
+
+// registration backoff kept between sessions - next search not before 'reg_retry' while 'reg_waiting' is set
+static uint32_t reg_delay = REG_BACKOFF_MIN;
+static uint32_t reg_retry = 0;
+static uint8_t reg_waiting = 0;
+
+// registration state, location area code and cell id, time of last +CREG: line
+static uint8_t reg_stat = REG_UNKNOWN;
+static uint16_t reg_lac = 0;
+static uint16_t reg_ci = 0;
+static uint32_t reg_updated = 0;
 
 
-void  dht_init(void)
-{
-   DHT_PIN_INPUT();
-   DHT_PIN_HIGH();
+// ----------------------------------------------------------------------------------------------
+// init_uart
+// ----------------------------------------------------------------------------------------------
+void init_uart(void) {
+  // double speed by U2X0 flag = 1 to have 0.2% error rate on 9600 baud
+ UCSR0A = (1<<U2X0);
+  // set baud rate from PRESCALER
+ UBRR0H = (uint8_t)(MYUBBR>>8);
+ UBRR0L = (uint8_t)(MYUBBR);
+ UCSR0B|=(1<<TXEN0); //enable TX
+ UCSR0B|=(1<<RXEN0); //enable RX
+ UCSR0B|=(1<<RXCIE0); //enable RX complete interrupt feeding rx_ring
+  // set frame format for SIM808 communication
+ UCSR0C|=(1<<UCSZ00)|(1<<UCSZ01); // no parity, 1 stop bit, 8-bit data 
+ sei();
 }
 
-static int8_t   dht_await_state(uint8_t state)
+
+
+// ----------------------------------------------------------------------------------------------
+// USART data register empty interrupt - send next char from TX queue
+// PROGMEM strings are streamed directly from flash, interrupt is disabled when queue is empty
+// ----------------------------------------------------------------------------------------------
+ISR(USART_UDRE_vect)
 {
-    uint8_t counter = 0;
-    while ((!DHT_PIN_READ() == state) && (++counter < DHT_TIMEOUT)) 
-     { 
-     // Delay 1 cycles
-     // 1us at 1.0 MHz CLOCK
-     asm volatile (
-        "    nop"	"\n"
-        );
+  const char *p;
+  uint8_t c;
+
+  if (tx_head == tx_tail)
+     { UCSR0B &= ~(1<<UDRIE0);
+       return;
      };
-    return counter;
-}
 
+  p = tx_pgm[tx_tail];
+  if (p == NULL)
+     { // single char entry
+       c = tx_char[tx_tail];
+       tx_tail = (tx_tail + 1) & TX_QUEUE_MASK;
+     }
+  else
+     { // PROGMEM string entry, go to next entry after its last char
+       c = pgm_read_byte(p++);
+       if (pgm_read_byte(p) == 0x00) tx_tail = (tx_tail + 1) & TX_QUEUE_MASK;
+                                else tx_pgm[tx_tail] = p;
+     };
 
-int8_t dht_read(uint8_t *temperature_hi, uint8_t *temperature_lo, uint8_t *humidity_hi, uint8_t *humidity_lo)
-{
-    uint8_t i, j, data[5] = {0, 0, 0, 0, 0};
+  // clear TX complete flag, it will be set again when this char leaves shift register
+  UCSR0A = (1<<U2X0) | (1<<TXC0);
+  UDR0 = c;
+  tx_sent = 1;
+}
 
-    // send start sequence 1 LOW pulse for 2 miliseconds
-    DHT_PIN_OUTPUT();
-    DHT_PIN_LOW();
 
-    // Delay 20 000 cycles
-    // 20ms at 1 MHz
-    asm volatile (
-         "    ldi  r18, 26"	"\n"
-         "    ldi  r19, 249"	"\n"
-         "1:  dec  r19"	"\n"
-         "    brne 1b"	"\n"
-         "    dec  r18"	"\n"
-         "    brne 1b"	"\n"
-          );
 
-    DHT_PIN_HIGH();
-    DHT_PIN_INPUT();
+// ----------------------------------------------------------------------------------------------
+// uart_wait_tx
+// Puts MCU into IDLE sleep until next interrupt while TX interrupt is still active
+// ----------------------------------------------------------------------------------------------
+void uart_wait_tx(void) {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  if (UCSR0B & (1<<UDRIE0))
+     { sleep_enable();
+       sei();
+       sleep_cpu();
+       sleep_disable();
+     };
+  sei();
+}
 
-    // read response sequence - 1 pulse  as preparation before sending measurement
-    if (dht_await_state(0) < 0) return DHT_ERR_TIMEOUT;
-    if (dht_await_state(1) < 0) return DHT_ERR_TIMEOUT;
-    if (dht_await_state(0) < 0) return DHT_ERR_TIMEOUT;
-    
 
-    // read data - 40 bits - HOGH pulse length goves info aboit 0s and 1s 
-    for (i = 0; i < 5; ++i) {
-        for (j = 0; j < 8; ++j) 
-          {
-         // wait for next BIT to come
-         dht_await_state(1);
-         // do left shift
-         data[i] <<= 1;
-         // received BIT is "1" if waiting for LOW longer than 28 microseconds - 
-         // the value = 1 in comparision is experimental for 1MHz clock, 20 for 8MHz
-         if (dht_await_state(0) > 1)  data[i] |= 1;   
-          };
-    };
 
-    // check if checksum matches
-    if (data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF) ) 
-     { 
-    *temperature_hi = data[2];
-    *temperature_lo = data[3];
-    *humidity_hi = data[0];
-    *humidity_lo = data[1];
+// ----------------------------------------------------------------------------------------------
+// tx_enqueue
+// Puts PROGMEM string pointer ( or single char if p = NULL ) into TX queue and starts transmission
+// if queue is full MCU sleeps until UDRE interrupt makes some room
+// ----------------------------------------------------------------------------------------------
+void tx_enqueue(const char *p, uint8_t c) {
+  uint8_t next;
 
-    }
-    else
-    {
-    *temperature_hi = 0;
-    *temperature_lo = 0;
-    *humidity_hi = 0;
-    *humidity_lo = 0;
+  next = (tx_head + 1) & TX_QUEUE_MASK;
+  while (next == tx_tail) uart_wait_tx();
 
-    }; 
+  tx_pgm[tx_head] = p;
+  tx_char[tx_head] = c;
+  tx_head = next;
 
-     
-    return DHT_ERR_OK;
+  // enable UDRE interrupt - it fires immediately if data register is empty
+  UCSR0B |= (1<<UDRIE0);
 }
 
 
 
 // ----------------------------------------------------------------------------------------------
-// init_uart
+// uart_flush_tx
+// Waits until TX queue is empty and last char has left the shift register, MCU idles meanwhile
+// needed before MCU goes to POWER DOWN sleep because USART is stopped then
 // ----------------------------------------------------------------------------------------------
-void init_uart(void) {
-  // double speed by U2X0 flag = 1 to have 0.2% error rate on 9600 baud
- UCSR0A = (1<<U2X0);
-  // set baud rate from PRESCALER
- UBRR0H = (uint8_t)(MYUBBR>>8);
- UBRR0L = (uint8_t)(MYUBBR);
- UCSR0B|=(1<<TXEN0); //enable TX
- UCSR0B|=(1<<RXEN0); //enable RX
-  // set frame format for SIM808 communication
- UCSR0C|=(1<<UCSZ00)|(1<<UCSZ01); // no parity, 1 stop bit, 8-bit data 
+void uart_flush_tx(void) {
+  while (UCSR0B & (1<<UDRIE0)) uart_wait_tx();
+  if (tx_sent)
+     { loop_until_bit_is_set(UCSR0A, TXC0);
+       tx_sent = 0;
+     };
 }
 
 
 
 // ----------------------------------------------------------------------------------------------
 // send_uart
-// Sends a single char to UART without ISR
+// Sends a single char to UART over TX queue
 // ----------------------------------------------------------------------------------------------
 void send_uart(uint8_t c) {
-  // wait for empty data register
-  while (!(UCSR0A & (1<<UDRE0)));
-  // set data into data register
-  UDR0 = c;
+  tx_enqueue(NULL, c);
 }
 
 
 
 // ----------------------------------------------------------------------------------------------
-// receive_uart
-// Receives a single char without ISR
+// USART RX complete interrupt - put received char into ring buffer
+// when the ring is full the new char is dropped, unread data is never overwritten
 // ----------------------------------------------------------------------------------------------
-uint8_t receive_uart() {
-  while ( !(UCSR0A & (1<<RXC0)) ) 
-    ; 
-  return UDR0; 
+ISR(USART_RX_vect)
+{
+  uint8_t c, next;
+
+  c = UDR0;
+  next = (rx_head + 1) & RX_RING_MASK;
+  if (next != rx_tail)
+     { rx_ring[rx_head] = c;
+       rx_head = next;
+     };
 }
 
 
+
 // ----------------------------------------------------------------------------------------------
-// function to search RX buffer for response  SUB IN RX_BUFFER STR
+// uart_getc
+// Takes a single char from RX ring buffer, returns UART_NO_DATA if ring is empty
 // ----------------------------------------------------------------------------------------------
-uint8_t is_in_rx_buffer(char *str, char *sub) {
-   uint8_t i, j=0, k;
-    for(i=0; i<BUFFER_SIZE; i++)
-    {
-      if(str[i] == sub[j])
-     {
-       for(k=i, j=0; str[k] && sub[j]; j++, k++)  // if NOT NULL on each of strings
-            if(str[k]!=sub[j])   break; // if different - start comparision with next char
-       // if(!sub[j]) return 1; 
-        if(j == strlen(sub)) return 1;  // full substring has been found        
-      }
-     }
-     // substring not found
-    return 0;
+uint16_t uart_getc(void) {
+  uint8_t c;
+
+  if (rx_head == rx_tail) return UART_NO_DATA;
+  c = rx_ring[rx_tail];
+  rx_tail = (rx_tail + 1) & RX_RING_MASK;
+  return c;
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// uart_wait_rx
+// Puts MCU into IDLE sleep until next interrupt if RX ring buffer is empty
+// interrupts are enabled just before SLEEP instruction so no char can be missed
+// ----------------------------------------------------------------------------------------------
+void uart_wait_rx(void) {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  cli();
+  if (rx_head == rx_tail)
+     { sleep_enable();
+       sei();
+       sleep_cpu();
+       sleep_disable();
+     };
+  sei();
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// receive_uart
+// Receives a single char from RX ring buffer, MCU is sleeping while waiting for it
+// ----------------------------------------------------------------------------------------------
+uint8_t receive_uart() {
+  uint16_t c;
+
+  while ( (c = uart_getc()) == UART_NO_DATA ) 
+    uart_wait_rx(); 
+  return (uint8_t)c; 
 }
 
- 
 
 // ----------------------------------------------------------------------------------------------
 // uart_puts
-// Sends a string.
+// Sends a string, chars are copied into TX queue so buffer can be reused right after the call
 // ----------------------------------------------------------------------------------------------
 void uart_puts(const char *s) {
   while (*s) {
@@ -282,367 +663,1834 @@ void uart_puts(const char *s) {
 
 // ----------------------------------------------------------------------------------------------
 // uart_puts_P
-// Sends a PROGMEM string.
+// Sends a PROGMEM string, only the pointer is queued - string is streamed from flash by ISR
 // ----------------------------------------------------------------------------------------------
 void uart_puts_P(const char *s) {
-  while (pgm_read_byte(s) != 0x00) {
-    send_uart(pgm_read_byte(s++));
-  }
+  if (pgm_read_byte(s) != 0x00) tx_enqueue(s, 0);
+}
+
+
+
+// ----------------------------------------------------------------------------------------------
+// init_tick
+// Timer0 in CTC mode generates interrupt every 1 ms
+// ----------------------------------------------------------------------------------------------
+void init_tick(void) {
+  TCCR0A = (1<<WGM01);          // CTC mode, TOP = OCR0A
+  OCR0A = TICK_OCR;
+  TCCR0B = TICK_PRESCALER;
+  TIMSK0 |= (1<<OCIE0A);        // compare match A interrupt
+  sei();
+}
+
+
+ISR(TIMER0_COMPA_vect)
+{
+  ticks_ms++;
+}
+
+
+// ----------------------------------------------------------------------------------------------
+// millis
+// Returns milliseconds since power on, 32 bit value is read with interrupts disabled
+// ----------------------------------------------------------------------------------------------
+uint32_t millis(void) {
+  uint32_t t;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+    t = ticks_ms;
+    };
+  return t;
 }
 
 
 
 // *********************************************************************************************************
-// READLINE from serial port that starts with CRLF and ends with CRLF and put to 'response' buffer what read
+// streaming parser of SIM800L lines - fed by readline_timeout() char by char as they arrive
+// every token from AT_TOKENS table still matching the beginning of the line is kept as a bit in tok_match
+// and compared directly with flash, so the line is classified when its last char arrives
+// line_token = TOK_xxx of recognised line, line_arg = offset in 'response' where arguments begin
 // *********************************************************************************************************
-uint8_t readline()
-{
-  uint16_t char1, i , wholeline ;
-  // wait for first CR-LF or exit after timeout i cycles
-   i = 0;
-   wholeline = 0;
-   response_pos = 0;
-  //
-   do {
-      // read chars in pairs to find combination CR LF
-      char1 = receive_uart();
-      // if CR-LF combination detected start to copy the response
-      if   (  char1 != 0x0a && char1 != 0x0d && response_pos < BUFFER_SIZE ) 
-         { response[response_pos] = char1; 
-           response_pos++;
-         };
+void parse_begin(void)
+{
+  tok_match = (1UL << AT_TOKENS_COUNT) - 1;
+  line_token = TOK_NONE;
+  line_arg = 0;
+  field_count = 0;
+  field_state = FLD_NEW;
+}
+
+
+// splits arguments into fields as chars arrive, only offsets and lengths are stored
+void field_char(uint8_t c, uint8_t pos)
+{
+  if (field_state == FLD_NEW)
+     { if (field_count >= AT_MAX_FIELDS)
+          { field_state = FLD_FULL;
+            return;
+          };
+       field_len[field_count] = 0;
+       field_count++;
+       if (c == '"')
+          { field_off[field_count-1] = pos + 1;
+            field_state = FLD_QUOTED;
+            return;
+          };
+       field_off[field_count-1] = pos;
+       field_state = FLD_PLAIN;
+     };
+
+  switch (field_state)
+     {
+       case FLD_PLAIN:  if (c == ',')  field_state = FLD_NEW;
+                        else  field_len[field_count-1]++;
+                        break;
+       case FLD_QUOTED: if (c == '"')  field_state = FLD_CLOSED;
+                        else  field_len[field_count-1]++;
+                        break;
+       case FLD_CLOSED: if (c == ',')  field_state = FLD_NEW;
+                        break;
+     };
+}
+
+
+void parse_char(uint8_t c, uint8_t pos)
+{
+  uint8_t t;
+  uint16_t bit;
+  char tc;
+
+  for (t = 0, bit = 1; (tok_match != 0) && (t < AT_TOKENS_COUNT); t++, bit <<= 1)
+    {
+      if ( !(tok_match & bit) ) continue;
+      tc = pgm_read_byte( (const char *)pgm_read_word(&AT_TOKENS[t]) + pos );
+      if (tc == 0x00)
+         { // whole token matched - arguments begin here ( after a space if there is one ), final result codes
+           // OK / ERROR must be the whole line ( parse_end ) so text only starting with them is not taken for one
+           tok_match &= ~bit;
+           if ( (t + 1) <= TOK_ERROR )  continue;
+           line_token = t + 1;
+           line_arg = (c == ' ') ? (pos + 1) : pos;
+           field_count = 0;
+           field_state = FLD_NEW;
+         }
+      else if (tc != c)  tok_match &= ~bit;
+    };
+
+  if ( (line_token != TOK_NONE) && (pos >= line_arg) )  field_char(c, pos);
+}
+
 
-      if    (  char1 == 0x0a || char1 == 0x0d )              
-         {  
-           // if the line was received and this is only CR/LF ending :
-           if (response_pos > 0) // this is EoL
-               { response[response_pos] = NULL;
-                 response_pos = 0;
-                  wholeline = 1;  };
-          // just skip this CRLF character and wait for valuable one
-               
+void parse_end(uint8_t len)
+{
+  uint8_t t;
+  uint16_t bit;
+
+  // tokens forming whole line like OK or ERROR
+  for (t = 0, bit = 1; (tok_match != 0) && (t < AT_TOKENS_COUNT); t++, bit <<= 1)
+    {
+      if ( (tok_match & bit) && (pgm_read_byte( (const char *)pgm_read_word(&AT_TOKENS[t]) + len ) == 0x00) )
+         { line_token = t + 1;
+           line_arg = len;
          };
-      // if buffer is empty exit from function there is nothing to read from
-      i++;
-      } while ( wholeline == 0);
+    };
+  tok_match = 0;
 
-return 1;
+  // line ending with comma has one more, empty field
+  if ( (field_state == FLD_NEW) && (field_count > 0) && (field_count < AT_MAX_FIELDS) )
+     { field_off[field_count] = len;
+       field_len[field_count] = 0;
+       field_count++;
+     };
 }
 
 
+// ----------------------------------------------------------------------------------------------
+// field access - values are read directly from 'response', nothing is copied unless asked for
+// ----------------------------------------------------------------------------------------------
+
+// checks if field 'n' is exactly the PROGMEM string
+uint8_t field_is_P(uint8_t n, const char *s) {
+  if (n >= field_count) return 0;
+  return ( (field_len[n] == strlen_P(s)) && (strncmp_P((const char *)response + field_off[n], s, field_len[n]) == 0) );
+}
 
+// decimal value of field 'n', conversion stops at first non digit, missing field gives 0
+uint16_t field_uint(uint8_t n) {
+  uint16_t v = 0;
+  uint8_t i, c;
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// delay procedure ASM based because _delay_ms() is working bad for 1 MHz clock MCU
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  if (n >= field_count) return 0;
+  for (i = 0; i < field_len[n]; i++)
+    {
+      c = response[field_off[n] + i];
+      if ( (c < '0') || (c > '9') ) break;
+      v = v * 10 + (c - '0');
+    };
+  return v;
+}
+
+// copies field 'n' as NULL terminated string to 'dst' of 'size' bytes, returns length copied
+uint8_t field_copy(uint8_t n, uint8_t *dst, uint8_t size) {
+  uint8_t i = 0;
+
+  if (n < field_count)
+    for (; (i < field_len[n]) && (i < size - 1); i++)  dst[i] = response[field_off[n] + i];
+  dst[i] = 0x00;
+  return i;
+}
+
+// value of hexadecimal field 'n' like "00C3" of +CREG:
+uint16_t field_hex(uint8_t n) {
+  uint16_t v = 0;
+  uint8_t i, c;
+
+  if (n >= field_count) return 0;
+  for (i = 0; i < field_len[n]; i++)
+    {
+      c = response[field_off[n] + i];
+      if ( (c >= '0') && (c <= '9') )       c = c - '0';
+      else if ( (c >= 'A') && (c <= 'F') )  c = c - 'A' + 10;
+      else if ( (c >= 'a') && (c <= 'f') )  c = c - 'a' + 10;
+      else break;
+      v = (v << 4) | c;
+    };
+  return v;
+}
 
-// delay partucular number of seconds 
 
-void delay_sec(uint8_t i)
+// ----------------------------------------------------------------------------------------------
+// every +CREG: line updates cached registration state, no matter which command was waiting for it
+// answer to AT+CREG? begins with <n> ( 2 or 4 fields ), unsolicited report does not ( 1 or 3 fields )
+// LAC and CI are given only when SIM800L is registered
+// ----------------------------------------------------------------------------------------------
+void reg_update(void)
 {
-while(i > 0)
+  uint8_t f;
+
+  f = (field_count & 1) ? 0 : 1;
+  reg_stat = field_uint(f);
+  if (field_count > (f + 2))
+     { reg_lac = field_hex(f + 1);
+       reg_ci = field_hex(f + 2);
+     };
+  reg_updated = millis();
+}
+
+// registered in HPLMN ( 1 ) or ROAMING NETWORK ( 5 ) according to fresh cache
+uint8_t reg_registered(void)
 {
-// Generated by delay loop calculator
-// at http://www.bretmulvey.com/avrdelay.html
-//
-// Delay 1 000 000 cycles
-// 1s at 1 MHz
+  if ( (reg_stat != 1) && (reg_stat != 5) )  return 0;
+  return ( (millis() - reg_updated) < REG_CACHE_TIME );
+}
+
+
 
-asm volatile (
-    "    ldi  r18, 6"	"\n"
-    "    ldi  r19, 19"	"\n"
-    "    ldi  r20, 174"	"\n"
-    "1:  dec  r20"	"\n"
-    "    brne 1b"	"\n"
-    "    dec  r19"	"\n"
-    "    brne 1b"	"\n"
-    "    dec  r18"	"\n"
-    "    brne 1b"	"\n"
-    "    rjmp 1f"	"\n"
-    "1:"	"\n"
-);
+// *********************************************************************************************************
+// READLINE from serial port that starts with CRLF and ends with CRLF and put to 'response' buffer what read
+// chars are taken from RX ring buffer, MCU stays in IDLE sleep between chars
+// every char is passed to streaming parser so line_token / line_arg are ready when the line ends
+// returns READLINE_TIMEOUT if whole line was not received within 'timeout' ms ( counted by system tick )
+// *********************************************************************************************************
+uint8_t readline_timeout(uint32_t timeout)
+{
+  uint32_t start;
+  uint16_t char1;
+
+  start = millis();
+  response_pos = 0;
+  parse_begin();
+
+  while ( (millis() - start) < timeout )
+   {
+      char1 = uart_getc();
+      // nothing received - sleep until next char or next timer tick
+      if (char1 == UART_NO_DATA)
+         { uart_wait_rx();
+           continue;
+         };
 
-i--;  // decrease another second
+      // if CR-LF combination detected start to copy the response
+      if   (  char1 != 0x0a && char1 != 0x0d ) 
+         { if ( response_pos < (BUFFER_SIZE - 1) )
+              { response[response_pos] = char1; 
+                parse_char(char1, response_pos);
+                response_pos++;
+              };
+           continue;
+         };
 
-};    // repeat until i not zero
+      // if the line was received and this is only CR/LF ending, otherwise skip CRLF and wait for valuable char
+      if (response_pos > 0) // this is EoL
+         { response[response_pos] = '\0';
+           parse_end(response_pos);
+           if (line_token == TOK_CREG)  reg_update();
+           response_pos = 0;
+           return READLINE_OK;
+         };
+   };
 
+  // keep what was received so far for diagnostics
+  response[response_pos] = '\0';
+  response_pos = 0;
+  return READLINE_TIMEOUT;
 }
 
 
-//////////////////////////////////////////
-// SIM800L initialization procedures
-//////////////////////////////////////////
+
 
 // *********************************************************************************************************
-// wait for first AT in case SIM800L is starting up
+// AT command engine - wait for final result code of a command sent to SIM800L
+// if 'urc' is TOK_NONE waits for OK, otherwise waits for line recognised as 'urc' token ( OK lines are skipped )
+// ERROR / +CME ERROR / +CMS ERROR finish the wait with AT_ERROR, no answer within 'timeout' ms gives AT_TIMEOUT
+// returns as soon as the modem answers, 'response' buffer keeps the line that ended the wait
 // *********************************************************************************************************
-uint8_t checkat()
+uint8_t at_wait(uint8_t urc, uint32_t timeout)
 {
-  uint8_t initialized2;
-
-// wait for first OK while sending AT - autosensing speed on SIM800L, but we are working 9600 bps
-// SIM 800L can be set by AT+IPR=9600  to fix this speed
-// which I do recommend by connecting SIM800L to PC using putty and FTD232 cable
+  uint32_t start, elapsed;
 
-                 initialized2 = 0;
-              do { 
-               uart_puts_P(AT);
-                if (readline()>0)
-                   {
-                    memcpy_P(buf, ISOK, sizeof(ISOK));                     
-                   if (is_in_rx_buffer(response, buf) == 1)  initialized2 = 1;                  
-                   };
-               delay_sec(1);
-               } while (initialized2 == 0);
+  start = millis();
 
-        // send ECHO OFF
-              uart_puts_P(ECHO_OFF);
+  while (1)
+   {
+     elapsed = millis() - start;
+     if (elapsed >= timeout) return AT_TIMEOUT;
+     if (readline_timeout(timeout - elapsed) == READLINE_TIMEOUT) return AT_TIMEOUT;
 
-             return initialized2;
+     if ( (urc != TOK_NONE) && (line_token == urc) )  return AT_OK;
+     if ( (line_token == TOK_ERROR) || (line_token == TOK_CME_ERROR) || (line_token == TOK_CMS_ERROR) )  return AT_ERROR;
+     if ( (urc == TOK_NONE) && (line_token == TOK_OK) )  return AT_OK;
+     // any other line ( echo, intermediate response, URC ) is ignored
+   };
 }
 
+
 // *********************************************************************************************************
-// check if PIN is needed and enter PIN 1111 
+// take lines waiting in RX ring buffer out before next command so old responses do not end the wait for new
+// ones, lines are not dropped - +CREG: reports among them still update the registration cache, CR / LF
+// between lines is skipped without waiting
 // *********************************************************************************************************
-uint8_t checkpin()
+void readline_drain(void)
 {
+  while (rx_head != rx_tail)
+     {
+       if ( (rx_ring[rx_tail] == 0x0d) || (rx_ring[rx_tail] == 0x0a) )  uart_getc();
+       else if (readline_timeout(RX_DRAIN_TIMEOUT) == READLINE_TIMEOUT)  break;
+     };
+}
 
-  uint8_t initialized2;
-     // readline and wait for PIN CODE STATUS if needed send PIN 1111 to SIM card if required
-                  initialized2 = 0;
-              do { 
-		delay_sec(2);
-               uart_puts_P(SHOW_PIN);
-                if (readline()>0)
-                   {
-                    memcpy_P(buf, PIN_IS_READY, sizeof(PIN_IS_READY));
-                  if (is_in_rx_buffer(response, buf ) == 1)       initialized2 = 1;                                         
-                    memcpy_P(buf, PIN_MUST_BE_ENTERED, sizeof(PIN_MUST_BE_ENTERED));
-                  if (is_in_rx_buffer(response, buf) == 1)     
-                        {  uart_puts_P(ENTER_PIN);   // ENTER PIN 1111
-                           delay_sec(1);
-                        };                  
-                    };
-                  
-              } while (initialized2 == 0);
-   return initialized2;
+
+// *********************************************************************************************************
+// send PROGMEM AT command and wait for OK / ERROR, see at_wait()
+// *********************************************************************************************************
+uint8_t at_command(const char *cmd, uint32_t timeout)
+{
+  readline_drain();
+  uart_puts_P(cmd);
+  return at_wait(TOK_NONE, timeout);
 }
 
 
 // *********************************************************************************************************
-// check if registered to the network
+// send PROGMEM AT command and wait for command specific response line ( like +HTTPACTION: ), see at_wait()
 // *********************************************************************************************************
-uint8_t checkregistration()
+uint8_t at_command_urc(const char *cmd, uint8_t urc, uint32_t timeout)
 {
-  uint8_t initialized2, nbrminutes;
-     // readline and wait for STATUS NETWORK REGISTRATION from SIM800L
-     // first 2 networks preferred from SIM list are OK
-                  initialized2 = 0;
-                  nbrminutes = 0;
-              do { 
-                   delay_sec(3);
-                 // check now if registered
-                   uart_puts_P(SHOW_REGISTRATION);
-                if (readline()>0)
-                   {			   
-                    memcpy_P(buf, ISREG1, sizeof(ISREG1));
-                   if (is_in_rx_buffer(response, buf) == 1)  initialized2 = 1; 
-                    memcpy_P(buf, ISREG2, sizeof(ISREG2));
-                   if (is_in_rx_buffer(response, buf) == 1)  initialized2 = 1; 
-                   }
-                // if not registered or something wrong turn off RADIO for some time (battery) and turn it on again
-                // this is not to drain battery in underground garage 
-                else
-                   {
-                   delay_sec(1);
-                   uart_puts_P(FLIGHTON);    // enable airplane mode - turn off radio for 3 minutes
-                   delay_sec(60);                      
-                   uart_puts_P(FLIGHTOFF);   // disable airplane mode - turn on radio and start to search for networks
-                   delay_sec(60);                      
-                 // give reasonable time to search for GSM network - 3 minutes is sufficient
-                   };
-                // end of DO loop
-                } while (initialized2 == 0);
+  readline_drain();
+  uart_puts_P(cmd);
+  return at_wait(urc, timeout);
+}
 
-      return initialized2;
-};
- 
+
+// *********************************************************************************************************
+// wait for '>' prompt of SIM800L after AT+CIPSEND, the prompt is not ended with CR/LF
+// *********************************************************************************************************
+uint8_t at_wait_prompt(uint32_t timeout)
+{
+  uint32_t start;
+  uint16_t char1;
+
+  start = millis();
+  while ( (millis() - start) < timeout )
+   {
+     char1 = uart_getc();
+     if (char1 == '>') return AT_OK;
+     if (char1 == UART_NO_DATA) uart_wait_rx();
+   };
+  return AT_TIMEOUT;
+}
 
 
 // *********************************************************************************************************
-//
-//                                                    MAIN PROGRAM
-//
+// signal quality from AT+CSQ - returns <rssi> 0..31, 99 when unknown or modem did not answer
 // *********************************************************************************************************
+uint8_t read_rssi(void)
+{
+  if (at_command_urc(SHOW_CSQ, TOK_CSQ, AT_TIMEOUT_CMD) != AT_OK) return 99;
+  if (field_count == 0) return 99;
+  return field_uint(0);
+}
 
-int main(void) {
 
-  uint8_t initialized, attempt;
+// *********************************************************************************************************
+// network time from AT+CCLK? - "yy/MM/dd,hh:mm:ss+zz" is put to 't' as yy,MM,dd,hh,mm,ss
+// returns AT_OK or AT_ERROR / AT_TIMEOUT when clock could not be read
+// *********************************************************************************************************
+uint8_t read_clock(uint8_t *t)
+{
+  uint8_t i, p;
 
-  uint8_t belowzero;
-  uint8_t temperature_hi, temperature_lo, humidity_hi, humidity_lo;   // for temperature and humidity calculations
-  uint16_t humidity = 0;
-  uint16_t temperature = 0;
-  uint16_t temporary;
+  if (at_command_urc(SHOW_CLOCK, TOK_CCLK, AT_TIMEOUT_CMD) != AT_OK) return AT_ERROR;
+  if ( (field_count == 0) || (field_len[0] < 17) ) return AT_ERROR;
+  for (i = 0; i < 6; i++)
+    {
+      p = field_off[0] + 3 * i;
+      t[i] = (response[p] - '0') * 10 + (response[p+1] - '0');
+    };
+  return AT_OK;
+}
 
-  // initialize 9600 baud 8N1 RS232
-  init_uart();
 
-  // delay 10 seconds for safe SIM800L startup and network registration
-  delay_sec(10);
-          
-  // try to communicate with SIM800L over AT
-  checkat();
-  delay_sec(2);
 
-   // Fix UART speed to 9600 bps to disable autosensing
-  uart_puts_P(SET9600); 
-  delay_sec(2);
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// delay procedures based on 1 ms system tick, MCU stays in IDLE sleep meanwhile 
+// RX ring buffer keeps collecting chars from SIM800L during the delay
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-   // Turn off blinking LED on SIM800L module to conserve energy
-  uart_puts_P(DISABLELED); 
-  delay_sec(1);
+// delay particular number of miliseconds
 
-   // Save settings to SIM800L
-  uart_puts_P(SAVECNF);
-  delay_sec(3);
+void delay_ms(uint32_t ms)
+{
+  uint32_t start;
+
+  start = millis();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  while ( (millis() - start) < ms )
+   {
+     sleep_mode();   // Timer0 interrupt wakes up MCU every 1 ms
+   };
+}
 
-   // check pin status, registration status and provision APN settings
-  checkpin();
-  delay_sec(2);
-  // disable airplane mode - turn on radio and start to search for networks 
-  uart_puts_P(FLIGHTOFF);   
-  delay_sec(60);                      
-  checkregistration();
-  
 
-  // neverending LOOP
 
-       while (1) {
+// -------------------------------------------------------------------------------------------------------
+// ---------------------------------------- DHT22  library CODE ------------------------------------------
+// -------------------------------------------------------------------------------------------------------
+// DHT pin PB0 is ICP1 - Timer1 input capture timestamps every falling edge of the frame in microseconds
+// ICR1 keeps the time of the edge so interrupt latency does not change measured bit length
+// reading runs in background : dht_start() begins it, start pulse and frame are handled by Timer1
+// interrupts, dht_poll() tells when it is done and dht_wait() gives the result
 
-                // Create connection to GPRS network - 3 attempts if needed, if not succesfull restart the modem 
-                 attempt = 0;
-                // clear the loop flag 
-                 initialized = 0;
 
+void  dht_init(void)
+{
+   DHT_PIN_INPUT();
+   DHT_PIN_HIGH();
+}
+
+
+// falling edge - only its time is stored so the interrupt is as short as possible, bits are decoded
+// by dht_poll() ( edges are less than 256us apart so low byte of ICR1 is enough )
+ISR(TIMER1_CAPT_vect)
+{
+  uint8_t n;
+
+  n = dht_edges;
+  dht_times[n] = ICR1L;
+  n++;
+  // whole frame received, no more captures
+  if (n >= DHT_EDGES)  TIMSK1 = 0;
+  dht_edges = n;
+}
+
+
+// start background reading - send LOW start pulse, Timer1 compare match will end it
+void dht_start(void)
+{
+    dht_edges = 0;
+    dht_result = DHT_BUSY;
+    dht_started = millis();
+
+    // send start sequence 1 LOW pulse for 20 miliseconds
+    DHT_PIN_OUTPUT();
+    DHT_PIN_LOW();
+
+    // Timer1 counting microseconds, capture on falling edge with noise canceler
+    TCCR1A = 0;
+    TCNT1 = 0;
+    OCR1A = DHT_START_PULSE;
+    TIFR1 = (1<<OCF1A) | (1<<ICF1);
+    TIMSK1 = (1<<OCIE1A);
+    TCCR1B = (1<<ICNC1) | DHT_T1_PRESCALER;
+}
+
+
+// end of start pulse - release the line and let the sensor answer
+ISR(TIMER1_COMPA_vect)
+{
+  DHT_PIN_HIGH();
+  DHT_PIN_INPUT();
+  TIFR1 = (1<<ICF1);
+  TIMSK1 = (1<<ICIE1);
+}
+
+
+// returns DHT_BUSY while reading is in progress, then DHT_ERR_OK / DHT_ERR_TIMEOUT / DHT_ERR_CHECKSUM
+int8_t dht_poll(void)
+{
+    uint8_t i;
+
+    if (dht_result != DHT_BUSY)  return dht_result;
+    if ( (dht_edges < DHT_EDGES) && ((millis() - dht_started) < DHT_JOB_TIMEOUT) )  return DHT_BUSY;
+
+    // frame received or sensor did not answer in time - stop Timer1
+    TIMSK1 = 0;
+    TCCR1B = 0;
+    DHT_PIN_HIGH();
+    DHT_PIN_INPUT();
+
+    // first two edges are sensor response, next 40 edges end bits - bit value is given by time from previous
+    // falling edge ( LOW 50us + HIGH 26us or 70us )
+    for (i = 0; i < 5; i++)  dht_data[i] = 0;
+    if (dht_edges >= DHT_EDGES)
+       for (i = 2; i < DHT_EDGES; i++)
+          {
+            dht_data[(i - 2) >> 3] <<= 1;
+            if ( (uint8_t)(dht_times[i] - dht_times[i - 1]) > DHT_BIT_THRESHOLD )  dht_data[(i - 2) >> 3] |= 1;
+          };
+
+    // check if all bits came and checksum matches
+    if (dht_edges < DHT_EDGES)  dht_result = DHT_ERR_TIMEOUT;
+    else if (dht_data[4] == ((dht_data[0] + dht_data[1] + dht_data[2] + dht_data[3]) & 0xFF) )  dht_result = DHT_ERR_OK;
+    else  dht_result = DHT_ERR_CHECKSUM;
+
+    return dht_result;
+}
+
+
+// waits in IDLE sleep until background reading is done and gives the values, zeros if reading failed
+int8_t dht_wait(uint8_t *temperature_hi, uint8_t *temperature_lo, uint8_t *humidity_hi, uint8_t *humidity_lo)
+{
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    while (dht_poll() == DHT_BUSY)
+     {
+       sleep_mode();
+     };
+
+    if (dht_result == DHT_ERR_OK)
+     { 
+    *temperature_hi = dht_data[2];
+    *temperature_lo = dht_data[3];
+    *humidity_hi = dht_data[0];
+    *humidity_lo = dht_data[1];
+
+    }
+    else
+    {
+    *temperature_hi = 0;
+    *temperature_lo = 0;
+    *humidity_hi = 0;
+    *humidity_lo = 0;
+
+    }; 
+
+     
+    return dht_result;
+}
+
+
+//////////////////////////////////////////
+// SIM800L initialization procedures
+//////////////////////////////////////////
+
+// *********************************************************************************************************
+// wait for first AT in case SIM800L is starting up
+// *********************************************************************************************************
+uint8_t checkat()
+{
+  uint8_t initialized2, attempt;
+
+// wait for first OK while sending AT - autosensing speed on SIM800L, but we are working 9600 bps
+// SIM 800L can be set by AT+IPR=9600  to fix this speed
+// which I do recommend by connecting SIM800L to PC using putty and FTD232 cable
+// returns 0 when SIM800L did not answer to CHECKAT_ATTEMPTS probes
+
+                 initialized2 = 0;
+              for (attempt = 0; (attempt < CHECKAT_ATTEMPTS) && (initialized2 == 0); attempt++)
+               if (at_command(AT, AT_TIMEOUT_PROBE) == AT_OK)  initialized2 = 1;
+
+        // send ECHO OFF
+              if (initialized2)  at_command(ECHO_OFF, AT_TIMEOUT_CMD);
+
+             return initialized2;
+}
+
+// *********************************************************************************************************
+// check if PIN is needed and enter PIN 1111 
+// *********************************************************************************************************
+uint8_t checkpin()
+{
+
+  uint8_t initialized2, attempt;
+     // ask for PIN CODE STATUS and send PIN 1111 to SIM card if required, SIM card still starting up answers
+     // with +CME ERROR and reports its state later with +CPIN: URC, so no fixed delays are needed
+     // returns 0 when SIM card is not ready after CHECKPIN_ATTEMPTS polls ( missing, wrong PIN, PUK locked )
+                  initialized2 = 0;
+              for (attempt = 0; (attempt < CHECKPIN_ATTEMPTS) && (initialized2 == 0); attempt++) { 
+                if (at_command_urc(SHOW_PIN, TOK_CPIN, AT_TIMEOUT_CMD) != AT_OK)
+                   {
+                     at_wait(TOK_CPIN, AT_TIMEOUT_CPIN);
+                     continue;
+                   };
+                if ( field_is_P(0, PIN_IS_READY) )       initialized2 = 1;                                         
+                if ( field_is_P(0, PIN_MUST_BE_ENTERED) )     
+                   {  // ENTER PIN 1111 and wait for +CPIN: READY
+                      if ( (at_command(ENTER_PIN, AT_TIMEOUT_CMD) == AT_OK) &&
+                           (at_wait(TOK_CPIN, AT_TIMEOUT_CPIN) == AT_OK) && field_is_P(0, PIN_IS_READY) )  initialized2 = 1;
+                   };
+                  
+              };
+   return initialized2;
+}
+
+
+// -------------------------------------------------------------------------------
+// WATCHDOG based sleep service - MCU sleeps in POWER DOWN mode and is woken up by WDT interrupt
+// WDT oscillator is not precise ( +/- 10% ) so its real period is measured against system tick
+// and system tick is advanced by measured period after every WDT wakeup ( drift correction )
+// -------------------------------------------------------------------------------
+
+void wdt_interrupt(uint8_t prescaler)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+    wdt_reset();
+    MCUSR &= ~(1 << WDRF);
+    WDTCSR = (1 << WDCE) | (1 << WDE);    // timed sequence to change WDT settings
+    WDTCSR = (1 << WDIE) | prescaler;     // interrupt mode only, no reset
+    };
+}
+
+void wdt_stop(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+    wdt_reset();
+    MCUSR &= ~(1 << WDRF);
+    WDTCSR = (1 << WDCE) | (1 << WDE);
+    WDTCSR = 0;
+    };
+}
+
+ISR(WDT_vect)
+{
+  ticks_ms += wdt_add_ms;     // Timer0 is stopped in POWER DOWN mode
+  wdt_fired = 1;
+}
+
+// measure real length of 1 second WDT period with Timer0 tick while MCU is in IDLE mode
+void wdt_calibrate(void)
+{
+  uint32_t start;
+
+  wdt_add_ms = 0;             // Timer0 is counting during calibration
+  wdt_fired = 0;
+  wdt_interrupt(WDT_1S);
+  start = millis();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  while (wdt_fired == 0)  sleep_mode();
+  wdt_period_ms = (uint16_t)((millis() - start) * 8);
+  wdt_calibrated_at = millis();
+  wdt_stop();
+}
+
+// power down until WDT interrupt ( or other enabled interrupt like INT0 )
+void powerdown(uint8_t prescaler, uint16_t period_ms)
+{
+  wdt_add_ms = period_ms;
+  wdt_fired = 0;
+  wdt_interrupt(prescaler);
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  cli();
+  sleep_enable();
+  sei();                      // SLEEP is executed before any pending interrupt
+  sleep_cpu();
+  sleep_disable();
+}
+
+// sleep until system tick reaches 'tick' ( milliseconds ), 8 second WDT periods first,
+// then 1 second periods, the rest in IDLE mode on Timer0
+void sleep_until(uint32_t tick)
+{
+  int32_t remaining;
+
+  if ( (wdt_period_ms == 0) || ((millis() - wdt_calibrated_at) > WDT_CALIBRATION_INTERVAL) )  wdt_calibrate();
+
+  // USART is stopped in POWER DOWN mode so send everything what is still in TX queue
+  uart_flush_tx();
+
+  while (1)
+   {
+     remaining = (int32_t)(tick - millis());
+     if (remaining <= 0) break;
+     if (remaining >= wdt_period_ms)            powerdown(WDT_8S, wdt_period_ms);
+     else if (remaining >= (wdt_period_ms / 8)) powerdown(WDT_1S, wdt_period_ms / 8);
+     else { delay_ms(remaining);
+            break;
+          };
+   };
+
+  wdt_stop();
+}
+
+
+// *********************************************************************************************************
+// wake up SIM800L from SLEEP MODE ( AT+CSCLK=2 ) - first AT only wakes up the modem and may be lost
+// *********************************************************************************************************
+uint8_t modemwakeup()
+{
+  uint8_t attempt;
+
+  for (attempt = 0; attempt < 5; attempt++)
+     if (at_command(AT, AT_TIMEOUT_PROBE) == AT_OK) break;
+  return at_command(SLEEPOFF, AT_TIMEOUT_CMD);
+}
+
+
+// 8 bit pseudo random number, xorshift of 'rnd_state'
+uint8_t random8(void)
+{
+  if (rnd_state == 0)  rnd_state = 1;
+  rnd_state ^= rnd_state << 7;
+  rnd_state ^= rnd_state >> 9;
+  rnd_state ^= rnd_state << 8;
+  return rnd_state >> 8;
+}
+
+// *********************************************************************************************************
+// check if registered to the network, state comes from +CREG: reports ( AT+CREG=2 ) so SIM800L is asked only
+// when cache is old or nothing was heard for REG_QUERY_TIME. While not registered SIM800L searches for
+// REG_SEARCH_TIME once per call, then radio is turned off and 0 is returned so the caller goes back to its
+// schedule, this is not to drain battery in underground garage. No new search is made before the backoff is
+// over, it doubles after every unsuccessful search up to REG_BACKOFF_MAX and random jitter is added so devices
+// of one site do not search all at the same time after an outage
+// *********************************************************************************************************
+uint8_t reg_backoff(void)
+{
+  return ( reg_waiting && ((int32_t)(reg_retry - millis()) > 0) );
+}
+
+uint8_t checkregistration()
+{
+  uint32_t start, asked;
+
+     if (reg_backoff())  return 0;
+     if (reg_waiting)
+        { // radio was turned off after last unsuccessful search
+          reg_waiting = 0;
+          at_command(FLIGHTOFF, AT_TIMEOUT_CFUN);    // disable airplane mode - turn on radio and start to search for networks
+        };
+     start = millis();
+     asked = start - REG_QUERY_TIME;
+     // first 2 networks preferred from SIM list are OK
+     while (reg_registered() == 0)
+        {
+          // if not registered or no answer from SIM800L for whole search time turn off RADIO
+          // and give up until the backoff is over
+          if ( (millis() - start) >= REG_SEARCH_TIME )
+             {
+               reg_attempts++;
+               at_command(FLIGHTON, AT_TIMEOUT_CFUN);     // enable airplane mode - turn off radio
+               reg_stat = REG_UNKNOWN;
+               reg_retry = millis() + reg_delay + (((reg_delay >> 8) * random8()) >> 2);
+               reg_waiting = 1;
+               if (reg_delay < (REG_BACKOFF_MAX / 2))  reg_delay = reg_delay * 2;
+               else  reg_delay = REG_BACKOFF_MAX;
+               return 0;
+             };
+
+          if ( (millis() - asked) >= REG_QUERY_TIME )
+             { // SIM800L forgets AT+CREG=2 when restarted so reports are enabled with every query
+               asked = millis();
+               at_command(REGISTRATION_REPORT, AT_TIMEOUT_CMD);
+               at_command(SHOW_REGISTRATION, AT_TIMEOUT_CMD);
+               // answer time of SIM800L differs between devices, good enough to seed the jitter
+               rnd_state ^= TCNT0;
+             }
+          // wait for +CREG: report, any line ends the wait and the cache is checked again
+          else  readline_timeout(REG_QUERY_TIME - (millis() - asked));
+
+          reg_elapsed = (millis() - start) / 1000;
+        };
+
+      reg_delay = REG_BACKOFF_MIN;
+      reg_attempts = 0;
+      return 1;
+};
+
+// -------------------------------------------------------------------------------
+// EEPROM SAMPLE LOG - ring of 32 byte blocks, every block begins with absolute sample
+// [sequence][temperature][humidity] 16 bits each, then one byte per next sample with 4 bit deltas
+// of temperature ( high nibble ) and humidity ( low nibble ) stored as delta + 7 ( -7 .. +7 )
+// nibble value 15 is never used so 0xFF ( erased cell ) ends the block, a delta out of range
+// starts a new block with absolute sample. 27 samples fit in 32 bytes instead of 162 bytes
+// the newest block is found at startup by its sequence number so there is no fixed index cell,
+// the ring is written block after block and wear is spread over whole EEPROM
+// -------------------------------------------------------------------------------
+
+// EEPROM address of 'block'
+uint8_t *log_addr(uint8_t block)
+{
+  return (uint8_t *)(block * LOG_BLOCK_SIZE);
+}
+
+// number of samples stored in 'block'
+uint8_t log_block_count(uint8_t block)
+{
+  uint8_t i;
+
+  for (i = 0; i < LOG_BLOCK_DELTAS; i++)
+     if (eeprom_read_byte(log_addr(block) + LOG_HEADER_SIZE + i) == 0xFF) break;
+  return i + 1;
+}
+
+// decoder - put absolute sample of 'block' to dec_temp / dec_hum
+void log_load(uint8_t block)
+{
+  uint16_t humidity;
+
+  dec_block = block;
+  dec_pos = 0;
+  dec_temp = (int16_t)eeprom_read_word((uint16_t *)(log_addr(block) + 2));
+  humidity = eeprom_read_word((uint16_t *)(log_addr(block) + 4));
+  dec_gap = ( (humidity & LOG_HUM_GAP) != 0 );
+  dec_restart = ( (humidity & LOG_HUM_RESTART) != 0 );
+  dec_hum = humidity & ~LOG_HUM_FLAGS;
+}
+
+// decoder - move to next sample, within the block or to the beginning of next block
+void log_next(void)
+{
+  uint8_t d;
+
+  d = 0xFF;
+  if (dec_pos < LOG_BLOCK_DELTAS)  d = eeprom_read_byte(log_addr(dec_block) + LOG_HEADER_SIZE + dec_pos);
+  if (d == 0xFF)
+     { log_load( (dec_block + 1) % LOG_BLOCKS );
+       return;
+     };
+  dec_pos++;
+  dec_restart = 0;
+  dec_gap = (d == LOG_GAP);
+  if (dec_gap)  return;
+  dec_temp += (int8_t)(d >> 4) - 7;
+  dec_hum += (int8_t)(d & 0x0F) - 7;
+}
+
+// decoder - find sample with sequence number 'seq', it must be still stored in the log
+void log_rewind(uint16_t seq)
+{
+  uint8_t block, i;
+  uint16_t first;
+
+  block = log_head;
+  for (i = 0; i < LOG_BLOCKS; i++)
+    {
+      first = eeprom_read_word((uint16_t *)log_addr(block));
+      if ( (first != LOG_SEQ_EMPTY) && (((seq - first) & LOG_SEQ_MASK) < log_block_count(block)) ) break;
+      block = (block + LOG_BLOCKS - 1) % LOG_BLOCKS;
+    };
+  log_load(block);
+  for (i = (seq - first) & LOG_SEQ_MASK; i > 0; i--)  log_next();
+}
+
+// find the newest block and continue after its last sample, samples not accepted by server before restart
+// are uploaded in next sessions
+void log_init(void)
+{
+  uint8_t block;
+  uint16_t seq, newest, oldest;
+
+  newest = LOG_SEQ_EMPTY;
+  for (block = 0; block < LOG_BLOCKS; block++)
+    {
+      seq = eeprom_read_word((uint16_t *)log_addr(block));
+      if (seq == LOG_SEQ_EMPTY) continue;
+      // sequence numbers are compared modulo LOG_SEQ_MASK + 1
+      if ( (newest == LOG_SEQ_EMPTY) || (((seq - newest) & LOG_SEQ_MASK) < (LOG_SEQ_MASK / 2)) )
+         { newest = seq;
+           log_head = block;
+         };
+    };
+
+  if (newest == LOG_SEQ_EMPTY)
+     { // empty log - first sample will begin block 0
+       log_head = LOG_BLOCKS - 1;
+       log_count = LOG_BLOCK_SAMPLES;
+       log_seq = 0;
+     }
+  else
+     { // decode the newest block to know last sample for next delta
+       log_count = log_block_count(log_head);
+       log_rewind( (newest + log_count - 1) & LOG_SEQ_MASK );
+       log_temp = dec_temp;
+       log_hum = dec_hum;
+       log_seq = (newest + log_count) & LOG_SEQ_MASK;
+     };
+
+  // time between the last sample and the first one after restart is not known, so that one begins
+  // new block marked with LOG_HUM_RESTART
+  log_count = LOG_BLOCK_SAMPLES;
+  log_restart = 1;
+
+  // the oldest sample still stored
+  oldest = log_seq;
+  for (block = 0; block < LOG_BLOCKS; block++)
+    {
+      seq = eeprom_read_word((uint16_t *)log_addr(block));
+      if ( (seq != LOG_SEQ_EMPTY) && (((log_seq - seq) & LOG_SEQ_MASK) > ((log_seq - oldest) & LOG_SEQ_MASK)) )
+           oldest = seq;
+    };
+
+  // continue from last acknowledged sample ( the newest slot, closest to log_seq ), unless it was overwritten meanwhile
+  log_sent = LOG_SEQ_EMPTY;
+  for (block = 0; block < LOG_SENT_SLOTS; block++)
+    {
+      seq = eeprom_read_word(LOG_SENT_ADDR + block);
+      if (seq == LOG_SEQ_EMPTY) continue;
+      if ( (log_sent == LOG_SEQ_EMPTY) || (((log_seq - seq) & LOG_SEQ_MASK) < ((log_seq - log_sent) & LOG_SEQ_MASK)) )
+         { log_sent = seq;
+           log_sent_slot = block;
+         };
+    };
+  if ( (log_sent == LOG_SEQ_EMPTY) || (((log_seq - log_sent) & LOG_SEQ_MASK) > ((log_seq - oldest) & LOG_SEQ_MASK)) )
+       log_sent = oldest;
+}
+
+// remember in EEPROM what server has got, every acknowledge goes to next slot of the ring so the wear
+// is spread like in the log itself
+void log_save_sent(void)
+{
+  log_sent_slot = (log_sent_slot + 1) % LOG_SENT_SLOTS;
+  eeprom_update_word(LOG_SENT_ADDR + log_sent_slot, log_sent);
+}
+
+// number of samples not uploaded yet
+uint16_t log_pending(void)
+{
+  return (log_seq - log_sent) & LOG_SEQ_MASK;
+}
+
+// start a new block with absolute sample, 'humidity' may carry LOG_HUM_GAP
+void log_block(int16_t temperature, uint16_t humidity)
+{
+  uint8_t *a;
+  uint8_t i;
+  uint16_t first;
+
+  log_head = (log_head + 1) % LOG_BLOCKS;
+  a = log_addr(log_head);
+
+  // the oldest block is overwritten - samples in it which were not uploaded yet are lost
+  first = eeprom_read_word((uint16_t *)a);
+  if ( (first != LOG_SEQ_EMPTY) &&
+       (log_pending() > ((log_seq - first - log_block_count(log_head)) & LOG_SEQ_MASK)) )
+       log_sent = (first + log_block_count(log_head)) & LOG_SEQ_MASK;
+
+  if (log_restart)  humidity |= LOG_HUM_RESTART;
+  log_restart = 0;
+
+  // sequence number is written last so half written block is not taken as valid
+  eeprom_update_word((uint16_t *)a, LOG_SEQ_EMPTY);
+  for (i = 0; i < LOG_BLOCK_DELTAS; i++)  eeprom_update_byte(a + LOG_HEADER_SIZE + i, 0xFF);
+  eeprom_update_word((uint16_t *)(a + 2), (uint16_t)temperature);
+  eeprom_update_word((uint16_t *)(a + 4), humidity);
+  eeprom_update_word((uint16_t *)a, log_seq);
+  log_count = 1;
+}
+
+// store a sample as delta to previous one or as absolute sample in a new block
+void log_append(int16_t temperature, uint16_t humidity)
+{
+  int16_t dt, dh;
+
+  dt = temperature - log_temp;
+  dh = (int16_t)(humidity - log_hum);
+
+  if ( (log_count < LOG_BLOCK_SAMPLES) && (dt >= -7) && (dt <= 7) && (dh >= -7) && (dh <= 7) )
+     {
+       eeprom_update_byte(log_addr(log_head) + LOG_HEADER_SIZE + log_count - 1, ((dt + 7) << 4) | (dh + 7));
+       log_count++;
+     }
+  else  log_block(temperature, humidity);
+
+  log_temp = temperature;
+  log_hum = humidity;
+  log_seq = (log_seq + 1) & LOG_SEQ_MASK;
+}
+
+// store sample period without reading, so the samples after it keep their time
+void log_gap(void)
+{
+  if (log_count < LOG_BLOCK_SAMPLES)
+     {
+       eeprom_update_byte(log_addr(log_head) + LOG_HEADER_SIZE + log_count - 1, LOG_GAP);
+       log_count++;
+     }
+  else  log_block(log_temp, log_hum | LOG_HUM_GAP);
+
+  log_seq = (log_seq + 1) & LOG_SEQ_MASK;
+}
+
+// number of oldest samples not uploaded yet which go in one upload, up to 'max' - the first sample
+// after restart begins next upload, time between it and the older ones is not known
+uint8_t log_batch(uint8_t max)
+{
+  uint8_t count, i;
+
+  count = (log_pending() > max) ? max : log_pending();
+  if (count == 0)  return 0;
+  log_rewind(log_sent);
+  for (i = 1; i < count; i++)
+    {
+      log_next();
+      if (dec_restart)  return i;
+    };
+  return count;
+}
+
+// send-on-delta - returns 1 when the last sample differs from the last uploaded one by dead band or more
+uint8_t log_changed(void)
+{
+  int16_t dt, dh;
+
+  if (sent_valid == 0)  return 1;
+  dt = log_temp - sent_temp;
+  dh = (int16_t)(log_hum - sent_hum);
+  if (dt < 0)  dt = -dt;
+  if (dh < 0)  dh = -dh;
+  return ( (dt >= DELTA_TEMPERATURE) || (dh >= DELTA_HUMIDITY) );
+}
+
+// all samples uploaded - the last one is new center of dead band and heartbeat starts again,
+// otherwise next attempt is after UPLOAD_RETRY. Returns system tick of next upload
+uint32_t log_delivered(void)
+{
+  if (log_pending() == 0)
+     { sent_temp = log_temp;
+       sent_hum = log_hum;
+       sent_valid = 1;
+       upload_hold = 0;
+       return millis() + HEARTBEAT_INTERVAL;
+     };
+  upload_hold = 1;
+  return millis() + UPLOAD_RETRY;
+}
+
+// alarm engine - new sample 'v' of 'channel', returns 1 when alarm state of the channel has changed
+uint8_t alarm_check(uint8_t channel, int16_t v, int16_t low, int16_t high, int16_t hyst)
+{
+  uint8_t state;
+
+  state = ALARM_NONE;
+  if ( (v < low) || ((alarm_state[channel] == ALARM_LOW) && (v < low + hyst)) )  state = ALARM_LOW;
+  if ( (v > high) || ((alarm_state[channel] == ALARM_HIGH) && (v > high - hyst)) )  state = ALARM_HIGH;
+
+  if (state == alarm_state[channel])
+     { alarm_count[channel] = 0;
+       return 0;
+     };
+  if (++alarm_count[channel] < ALARM_DEBOUNCE)  return 0;
+  alarm_state[channel] = state;
+  alarm_count[channel] = 0;
+  return 1;
+}
+
+
+
+// -------------------------------------------------------------------------------
+// GPRS SESSION - radio stays on in this version so IP bearer is kept open between uploads,
+// AT+SAPBR=2,1 checks it before use and it is built again only when it went down
+// -------------------------------------------------------------------------------
+
+// returns 1 when IP bearer is up
+uint8_t bearer_up(void)
+{
+  uint8_t attempt;
+
+  // +SAPBR: <cid>,<status>,<ip> - status 1 is connected
+  if ( (at_command_urc(SAPBRQUERY, TOK_SAPBR, AT_TIMEOUT_CMD) == AT_OK) && (field_uint(1) == 1) )  return 1;
+
+  // HTTP service of lost bearer is not usable any more
+  if (http_ready)
+     { at_command(HTTPTERM, AT_TIMEOUT_CMD);
+       http_ready = 0;
+     };
+
+  // Create connection to GPRS network - 3 attempts if needed
+  for (attempt = 0; attempt < 3; attempt++)
+     {
+       // first check if network is available, no retries when the search has to wait for backoff
+       if (checkregistration() == 0)  return 0;
+       //and close the bearer first maybe there was an error or something
+       at_command(SAPBRCLOSE, AT_TIMEOUT_SAPBR);
+       // connection to GPRS for AGPS basestation data - provision APN and username
+       at_command(SAPBR1, AT_TIMEOUT_CMD);
+       at_command(SAPBR2, AT_TIMEOUT_CMD);
+       // only if username password in APN is needed
+       at_command(SAPBR3, AT_TIMEOUT_CMD);
+       at_command(SAPBR4, AT_TIMEOUT_CMD);
+       // make GPRS network attach and open IP bearer
+       at_command(SAPBROPEN, AT_TIMEOUT_SAPBR);
+       // query PDP context for IP address, check if GPRS attach was succesfull
+       if ( (at_command_urc(SAPBRQUERY, TOK_SAPBR, AT_TIMEOUT_CMD) == AT_OK) && (field_uint(1) == 1) )  return 1;
+     };
+  return 0;
+}
+
+
+
+// decimal text of 'v' for AT commands, JSON and CIPSEND length
+const char *format_uint(uint32_t v)
+{
+  uint8_t i;
+
+  i = 10;
+  numtxt[10] = 0x00;
+  do {
+       numtxt[--i] = (v % 10) + 48;
+       v = v / 10;
+     } while (v != 0);
+  return (const char *)(numtxt + i);
+}
+
+void out_P(const char *s)
+{
+  out_len += strlen_P(s);
+  if (out_send)  uart_puts_P(s);
+}
+
+void out_str(const char *s)
+{
+  out_len += strlen(s);
+  if (out_send)  uart_puts(s);
+}
+
+#if UPLINK == UPLINK_HTTP
+
+// -------------------------------------------------------------------------------
+// THINGSPEAK BULK UPLOAD - samples from EEPROM log are sent in one HTTP POST as JSON
+// {"write_api_key":"KEY","updates":[{"delta_t":0,"field1":"023.4","field2":"045.6"},...]}
+// AT+HTTPDATA needs body length first, so the body is produced twice : counted, then sent
+// -------------------------------------------------------------------------------
+
+// 10 times value as 3 digits with dot in 'dhttxt', MINUS or ZERO character in front
+void format_reading(int16_t v)
+{
+  uint16_t temporary;
+
+  if (v < 0)
+     { dhttxt[0] = 45;   // MINUS character
+       v = -v;
+     }
+  else  dhttxt[0] = 48;  // ZERO character
+  dhttxt[1] = (v / 100) + 48;  // calculate ASCII code for digits
+  temporary = v % 100; 
+  dhttxt[2] = (temporary / 10) + 48;
+  dhttxt[3] = 46 ;  // the DOT character
+  dhttxt[4] = (temporary % 10) + 48; 
+}
+
+// JSON body with 'count' oldest records not uploaded yet, delta_t is time from previous sample
+// sample periods without reading are left out and make delta_t of the next record longer
+void upload_body(uint8_t count)
+{
+  uint8_t i, records;
+  uint16_t delta;
+
+  out_P(JSON1);
+  out_P(HTTPAPIKEY);
+  out_P(JSON2);
+  log_rewind(log_sent);
+  records = 0;
+  delta = 0;
+  for (i = 0; i < count; i++)
+    {
+      if (i != 0)
+         { log_next();
+           delta += SAMPLE_INTERVAL / 1000UL;
+         };
+      if (dec_gap)  continue;
+      if (records != 0)  out_P(JSON3);
+      out_P(JSON4);
+      out_str(format_uint( (records == 0) ? 0 : delta ));
+      records++;
+      delta = 0;
+      out_P(JSON5);
+      format_reading(dec_temp);
+      out_str((const char *)dhttxt);
+      out_P(JSON6);
+      format_reading((int16_t)dec_hum);
+      out_str((const char *)dhttxt);
+      out_P(JSON7);
+    };
+  out_P(JSON8);
+}
+
+// send up to HTTP_UPLOAD_MAX waiting samples decoded from EEPROM log over open IP bearer
+// samples are removed from the queue only when server accepted them ( status 2xx )
+// returns HTTP status from +HTTPACTION: ( 6xx are SIM800L network errors ), 0 if there was no answer
+uint16_t upload_log(void)
+{
+  uint8_t count, i;
+  uint16_t status;
+
+  count = log_batch(HTTP_UPLOAD_MAX);
+  if (count == 0)  return 0;
+
+  // only sample periods without reading - there is nothing to post, they are taken as accepted
+  log_rewind(log_sent);
+  for (i = 1; (i < count) && dec_gap; i++)  log_next();
+  if (dec_gap)
+     { log_sent = (log_sent + count) & LOG_SEQ_MASK;
+       log_save_sent();
+       return 200;
+     };
+
+  // initialize HTTP communication on SIM800L, only once while it works
+  if (http_ready == 0)
+     {
+       at_command(HTTPINIT, AT_TIMEOUT_CMD);
+       at_command(HTTPPARA, AT_TIMEOUT_CMD);
+       readline_drain();
+       uart_puts_P(HTTPTSPK1);
+       uart_puts_P(HTTPCHANNEL);
+       uart_puts_P(HTTPTSPK2);
+       at_wait(TOK_NONE, AT_TIMEOUT_CMD);
+       at_command(HTTPCONTENT, AT_TIMEOUT_CMD);
+       http_ready = 1;
+     };
+
+  // count the body and announce its length
+  out_send = 0;
+  out_len = 0;
+  upload_body(count);
+  readline_drain();
+  uart_puts_P(HTTPDATA1);
+  uart_puts(format_uint(out_len));
+  uart_puts_P(HTTPDATA2);
+
+  // after DOWNLOAD SIM800L takes exactly out_len bytes of the body
+  status = 0;
+  if (at_wait(TOK_DOWNLOAD, AT_TIMEOUT_CMD) == AT_OK)
+     { out_send = 1;
+       upload_body(count);
+       at_wait(TOK_NONE, AT_TIMEOUT_CMD);
+       // bigger backlog goes in several bulk updates, Thingspeak refuses the next one sooner than HTTP_UPLOAD_SPACING
+       while ( (millis() - http_posted) < HTTP_UPLOAD_SPACING )  delay_ms(HTTP_UPLOAD_SPACING - (millis() - http_posted));
+       // send prepared HTTP POST and wait for the answer from the server
+       // +HTTPACTION: <method>,<status>,<length> - Thingspeak answers 202 to bulk update
+       if (at_command_urc(HTTPACTION, TOK_HTTPACTION, AT_TIMEOUT_HTTP) == AT_OK)  status = field_uint(1);
+       http_posted = millis();
+#if HTTP_READ_REPLY
+       if (status != 0)  at_command(HTTPREAD, AT_TIMEOUT_CMD);
+#endif
+     };
+
+  // no answer or network error - release HTTP service, it is initialised again with next request
+  if ( (status == 0) || (status >= 600) )
+     { at_command(HTTPTERM, AT_TIMEOUT_CMD);
+       http_ready = 0;
+     };
+
+  if ( (status >= 200) && (status < 300) )
+     { // remember in EEPROM what server has got, next session continues with newer samples
+       log_sent = (log_sent + count) & LOG_SEQ_MASK;
+       log_save_sent();
+     };
+  // otherwise samples stay queued for next session
+  return status;
+}
+
+#else
+
+// -------------------------------------------------------------------------------
+// TCP/IP CONNECTION - binary frame and MQTT packets are sent with AT+CIPSEND, bytes go through out_byte()
+// so the same code counts the length and sends the data
+// -------------------------------------------------------------------------------
+
+void out_byte(uint8_t c)
+{
+  out_len++;
+  out_crc = _crc_xmodem_update(out_crc, c);
+  if (out_send)  send_uart(c);
+}
+
+void out_word(uint16_t w)
+{
+  out_byte(w >> 8);
+  out_byte(w & 0xFF);
+}
+
+// seconds since 2000-01-01 of yy,MM,dd,hh,mm,ss from read_clock(), 0 when clock was not set by network
+uint32_t clock_seconds(uint8_t *t)
+{
+  uint16_t days;
+
+  // SIM800L clock not synchronised with network starts in 2004
+  if ( (t[0] < 20) || (t[1] < 1) || (t[1] > 12) )  return 0;
+  days = (t[0] * 365) + ((t[0] + 3) / 4) + pgm_read_word(&DAYS_BEFORE_MONTH[t[1] - 1]) + t[2] - 1;
+  if ( ((t[0] % 4) == 0) && (t[1] > 2) )  days++;
+  return ( (((uint32_t)days * 24 + t[3]) * 60 + t[4]) * 60 ) + t[5];
+}
+
+// next byte of data from the server or UART_NO_DATA after timeout, data is shown as +IPD,<length>:<data>
+// ( AT+CIPHEAD=1 ), text of SIM800L between data blocks is skipped
+uint16_t ipd_getc(uint32_t timeout)
+{
+  uint32_t start;
+  uint16_t char1, len;
+  uint8_t matched;
+
+  start = millis();
+  matched = 0;
+  len = 0;
+  while ( (millis() - start) < timeout )
+   {
+     char1 = uart_getc();
+     if (char1 == UART_NO_DATA)
+        { uart_wait_rx();
+          continue;
+        };
+     if (ipd_left > 0)
+        { ipd_left--;
+          return char1;
+        };
+     // +IPD, matched, decimal length follows until ':'
+     if (pgm_read_byte(ISIPD + matched) == 0x00)
+        { if ( (char1 >= '0') && (char1 <= '9') )  len = (len * 10) + (char1 - '0');
+          else
+             { if (char1 == ':')  ipd_left = len;
+               matched = 0;
+               len = 0;
+             };
+        }
+     else if (char1 == pgm_read_byte(ISIPD + matched))  matched++;
+     else  matched = (char1 == '+') ? 1 : 0;
+   };
+  return UART_NO_DATA;
+}
+
+// local IP address must be asked before first connection, SIM800L answers only with the address
+uint8_t cip_address(void)
+{
+  readline_drain();
+  uart_puts_P(CIFSR);
+  if (readline_timeout(AT_TIMEOUT_CMD) == READLINE_TIMEOUT)  return AT_TIMEOUT;
+  return (line_token == TOK_ERROR) ? AT_ERROR : AT_OK;
+}
+
+// bring up wireless connection of SIM800L TCP/IP stack ( AT+CSTT / AT+CIICR ), returns 1 when it is up
+uint8_t cip_up(void)
+{
+  uint8_t attempt;
+
+  // connection is kept between uploads, check if it is still up
+  if (cip_address() == AT_OK)  return 1;
+
+  for (attempt = 0; attempt < 3; attempt++)
+     {
+       // first check if network is available, no retries when the search has to wait for backoff
+       if (checkregistration() == 0)  return 0;
+       // start from IP INITIAL state
+       at_command_urc(CIPSHUT, TOK_SHUT, AT_TIMEOUT_CIP);
+       at_command(CIPHEAD, AT_TIMEOUT_CMD);
+       at_command(CSTT, AT_TIMEOUT_CMD);
+       // make GPRS network attach and bring up wireless connection
+       if (at_command(CIICR, AT_TIMEOUT_SAPBR) != AT_OK)  continue;
+       if (cip_address() == AT_OK)  return 1;
+     };
+  return 0;
+}
+
+// open connection to SERVER_HOST, OK comes first, then CONNECT OK or CONNECT FAIL
+uint8_t cip_open(void)
+{
+  uint8_t result;
+
+  ipd_left = 0;
+  readline_drain();
+  uart_puts_P(CIPSTART1);
+  uart_puts_P(SERVER_HOST);
+  uart_puts_P(CIPSTART2);
+  uart_puts_P(SERVER_PORT);
+  uart_puts_P(CIPSTART3);
+  result = at_wait(TOK_CONNECT, AT_TIMEOUT_CIP);
+  if ( (result == AT_OK) && !field_is_P(0, ISOK) )  result = AT_ERROR;
+  return result;
+}
+
+// announce 'len' bytes of data and wait for the prompt, then exactly 'len' bytes must be sent
+uint8_t cip_send(uint16_t len)
+{
+  readline_drain();
+  uart_puts_P(CIPSEND);
+  uart_puts(format_uint(len));
+  uart_puts_P(CIPSEND2);
+  return at_wait_prompt(AT_TIMEOUT_CMD);
+}
+
+#if UPLINK == UPLINK_MQTT
+
+// -------------------------------------------------------------------------------
+// MQTT PUBLISH - waiting samples are published to own broker in one message, CONNECT and PUBLISH go in one
+// CIPSEND, topic comes from PROGMEM and message is generated from EEPROM log twice : counted, then sent
+// {"device":1,"seq":12,"time":762566400,"interval":600,"lac":195,"ci":3882,"samples":[[231,456],[-12,1000]]}
+// values are 10 times temperature and humidity, time is like in binary frame, lac and ci of serving cell
+// -------------------------------------------------------------------------------
+
+// remaining length of MQTT packet, 7 bits in each byte, highest bit means more bytes follow
+void mqtt_length(uint16_t len)
+{
+  do {
+       out_byte( (len > 127) ? ((len & 0x7F) | 0x80) : len );
+       len = len >> 7;
+     } while (len != 0);
+}
+
+void mqtt_string_P(const char *s)
+{
+  out_word(strlen_P(s));
+  out_P(s);
+}
+
+void mqtt_connect(void)
+{
+  uint8_t flags;
+  uint16_t len;
+
+  // clean session, user name and password only when given
+  flags = 0x02;
+  len = 10 + 2 + strlen_P(MQTT_CLIENT);
+  if (strlen_P(MQTT_USER) != 0)
+     { flags |= 0xC0;
+       len += 2 + strlen_P(MQTT_USER) + 2 + strlen_P(MQTT_PASSWORD);
+     };
+  out_byte(MQTT_CONNECT);
+  mqtt_length(len);
+  mqtt_string_P(MQTT_PROTOCOL);
+  out_byte(0x04);                  // protocol level of MQTT 3.1.1
+  out_byte(flags);
+  out_word(MQTT_KEEPALIVE);
+  mqtt_string_P(MQTT_CLIENT);
+  if (flags & 0x80)
+     { mqtt_string_P(MQTT_USER);
+       mqtt_string_P(MQTT_PASSWORD);
+     };
+}
+
+// JSON message with 'count' oldest samples not published yet, null for sample period without reading
+void mqtt_message(uint8_t count)
+{
+  uint8_t i;
+
+  log_rewind(log_sent);
+  out_P(MQTTJSON1);
+  out_str(format_uint(DEVICE_ID));
+  out_P(MQTTJSON2);
+  out_str(format_uint(log_sent));
+  out_P(MQTTJSON3);
+  out_str(format_uint(frame_time));
+  out_P(MQTTJSON4);
+  out_str(format_uint(SAMPLE_INTERVAL / 1000UL));
+  out_P(MQTTJSON7);
+  out_str(format_uint(reg_lac));
+  out_P(MQTTJSON8);
+  out_str(format_uint(reg_ci));
+  if (dec_restart)  out_P(MQTTJSON9);
+  out_P(MQTTJSON5);
+
+  for (i = 0; i < count; i++)
+    {
+      if (i != 0)
+         { out_byte(',');
+           log_next();
+         };
+      if (dec_gap)
+         { out_P(MQTTJSON10);
+           continue;
+         };
+      out_byte('[');
+      if (dec_temp < 0)
+         { out_byte('-');
+           out_str(format_uint(-dec_temp));
+         }
+      else  out_str(format_uint(dec_temp));
+      out_byte(',');
+      out_str(format_uint(dec_hum));
+      out_byte(']');
+    };
+  out_P(MQTTJSON6);
+}
+
+// PUBLISH of 'len' bytes long message, packet identifier is sequence number of first sample + 1 ( never 0 )
+void mqtt_publish(uint8_t count, uint16_t len)
+{
+  out_byte(MQTT_PUBLISH | (MQTT_QOS << 1));
+  mqtt_length(2 + strlen_P(MQTT_TOPIC) + ((MQTT_QOS > 0) ? 2 : 0) + len);
+  mqtt_string_P(MQTT_TOPIC);
+#if MQTT_QOS > 0
+  out_word(log_sent + 1);
+#endif
+  mqtt_message(count);
+}
+
+// wait for CONNACK or PUBACK of the broker, both are 4 bytes long, last 2 bytes must be equal to 'check'
+// ( session present flag and return code 0 of CONNACK, packet identifier of PUBACK )
+uint8_t mqtt_wait(uint8_t type, uint16_t check)
+{
+  uint8_t packet[4];
+  uint8_t i;
+  uint16_t char1;
+
+  for (i = 0; i < 4; i++)
+     {
+       char1 = ipd_getc(AT_TIMEOUT_ACK);
+       if (char1 == UART_NO_DATA)  return AT_TIMEOUT;
+       packet[i] = char1;
+     };
+  if ( (packet[0] != type) || (packet[1] != 0x02) )  return AT_ERROR;
+  return ( (((uint16_t)packet[2] << 8) | packet[3]) == check ) ? AT_OK : AT_ERROR;
+}
+
+// publish up to UPLOAD_MAX waiting samples in one message, samples are removed from the queue only when
+// the broker has accepted them, returns AT_OK in that case
+uint8_t upload_mqtt(void)
+{
+  uint8_t count, result;
+  uint16_t len;
+  uint8_t t[6];
+
+  count = log_batch(UPLOAD_MAX);
+  if (count == 0)  return AT_OK;
+
+  frame_time = 0;
+  if (read_clock(t) == AT_OK)  frame_time = clock_seconds(t);
+
+  result = cip_open();
+  if (result == AT_OK)
+     {
+       // count the message, then both packets
+       out_send = 0;
+       out_len = 0;
+       mqtt_message(count);
+       len = out_len;
+       out_len = 0;
+       mqtt_connect();
+       mqtt_publish(count, len);
+       result = cip_send(out_len);
+     };
+
+  if (result == AT_OK)
+     {
+       out_send = 1;
+       mqtt_connect();
+       mqtt_publish(count, len);
+       // SEND OK is not waited for, CONNACK may come before it
+       result = mqtt_wait(MQTT_CONNACK, 0);
+#if MQTT_QOS > 0
+       if (result == AT_OK)  result = mqtt_wait(MQTT_PUBACK, log_sent + 1);
+#endif
+     };
+
+  // broker closes the connection without DISCONNECT as if it was lost
+  if ( (result == AT_OK) && (cip_send(2) == AT_OK) )
+     {
+       out_send = 1;
+       out_byte(MQTT_DISCONNECT);
+       out_byte(0x00);
+       at_wait(TOK_SEND, AT_TIMEOUT_CIP);
+     };
+  at_command_urc(CIPCLOSE, TOK_CLOSE, AT_TIMEOUT_CMD);
+
+  if (result == AT_OK)
+     { // remember in EEPROM what broker has got, next session continues with newer samples
+       log_sent = (log_sent + count) & LOG_SEQ_MASK;
+       log_save_sent();
+     };
+  // otherwise samples stay queued for next session
+  return result;
+}
+
+#else
+
+// -------------------------------------------------------------------------------
+// BINARY FRAME UPLINK - waiting samples are sent to own server in one compact frame with AT+CIPSEND,
+// UDP : delivered when SIM800L has sent it, TCP : delivered when server answered with FRAME_ACK byte
+// [version][device id 16][sequence of first sample 16][time 32][sample interval in minutes][count]
+// [first sample : temperature 16, humidity 16][next samples : byte of 4 bit deltas like in EEPROM log
+// or 0xFF followed by absolute sample or 0xF0 for sample period without reading][CRC16 XMODEM of all
+// previous bytes], values are big endian, bit 15 of first humidity is set when the first sample is without
+// reading ( deltas go from the values given ), bit 14 when it is the first after restart
+// time is seconds since 2000-01-01 from network clock of the moment of sending, 0 when not known
+// -------------------------------------------------------------------------------
+
+void frame_body(uint8_t count)
+{
+  uint8_t i;
+  int16_t dt, dh, temperature;
+  uint16_t humidity;
+
+  out_byte(FRAME_VERSION);
+  out_word(DEVICE_ID);
+  out_word(log_sent);
+  out_word(frame_time >> 16);
+  out_word(frame_time & 0xFFFF);
+  out_byte(SAMPLE_INTERVAL / 60000UL);
+  out_byte(count);
+
+  log_rewind(log_sent);
+  for (i = 0; i < count; i++)
+    {
+      if (i != 0)
+         { temperature = dec_temp;
+           humidity = dec_hum;
+           log_next();
+           if (dec_gap)
+              { out_byte(LOG_GAP);
+                continue;
+              };
+           dt = dec_temp - temperature;
+           dh = (int16_t)(dec_hum - humidity);
+           if ( (dt >= -7) && (dt <= 7) && (dh >= -7) && (dh <= 7) )
+              { out_byte( ((dt + 7) << 4) | (dh + 7) );
+                continue;
+              };
+           // escape - absolute sample follows
+           out_byte(0xFF);
+         };
+      out_word((uint16_t)dec_temp);
+      if (i == 0)  out_word( dec_hum | (dec_gap ? LOG_HUM_GAP : 0) | (dec_restart ? LOG_HUM_RESTART : 0) );
+      else  out_word(dec_hum);
+    };
+}
+
+// wait for 1 byte acknowledge of the server
+uint8_t frame_wait_ack(uint32_t timeout)
+{
+  uint16_t char1;
+
+  char1 = ipd_getc(timeout);
+  if (char1 == UART_NO_DATA)  return AT_TIMEOUT;
+  return (char1 == FRAME_ACK) ? AT_OK : AT_ERROR;
+}
+
+// send up to UPLOAD_MAX waiting samples as one frame, samples are removed from the queue only when
+// the frame was delivered, returns AT_OK in that case
+uint8_t upload_frame(void)
+{
+  uint8_t count, result;
+  uint8_t t[6];
+
+  count = log_batch(UPLOAD_MAX);
+  if (count == 0)  return AT_OK;
+
+  frame_time = 0;
+  if (read_clock(t) == AT_OK)  frame_time = clock_seconds(t);
+
+  result = cip_open();
+
+  if (result == AT_OK)
+     {
+       // count the frame and announce its length with CRC
+       out_send = 0;
+       out_len = 0;
+       out_crc = 0;
+       frame_body(count);
+       result = cip_send(out_len + 2);
+     };
+
+  if (result == AT_OK)
+     {
+       out_send = 1;
+       out_crc = 0;
+       frame_body(count);
+       out_word(out_crc);
+       // SEND OK or SEND FAIL
+       result = at_wait(TOK_SEND, AT_TIMEOUT_CIP);
+       if ( (result == AT_OK) && !field_is_P(0, ISOK) )  result = AT_ERROR;
+#if UPLINK == UPLINK_TCP
+       if (result == AT_OK)  result = frame_wait_ack(AT_TIMEOUT_ACK);
+#endif
+     };
+
+  at_command_urc(CIPCLOSE, TOK_CLOSE, AT_TIMEOUT_CMD);
+
+  if (result == AT_OK)
+     { // remember in EEPROM what server has got, next session continues with newer samples
+       log_sent = (log_sent + count) & LOG_SEQ_MASK;
+       log_save_sent();
+     };
+  // otherwise samples stay queued for next session
+  return result;
+}
+
+#endif
+#endif
+
+
+// send one batch of waiting samples over selected uplink, returns AT_OK when it was delivered
+uint8_t upload(void)
+{
+#if UPLINK == UPLINK_HTTP
+  uint16_t status;
+
+  status = upload_log();
+  return ( (status >= 200) && (status < 300) ) ? AT_OK : AT_ERROR;
+#elif UPLINK == UPLINK_MQTT
+  return upload_mqtt();
+#else
+  return upload_frame();
+#endif
+}
+
+
+// *********************************************************************************************************
+//
+//                                                    MAIN PROGRAM
+//
+// *********************************************************************************************************
+
+int main(void) {
+
+  uint8_t initialized;
+  uint8_t sample_due, upload_due;
+  uint32_t next_sample, next_upload;                                  // system tick of next sample / heartbeat upload
+
+  uint8_t temperature_hi, temperature_lo, humidity_hi, humidity_lo;   // for temperature and humidity calculations
+  uint16_t humidity = 0;
+  int16_t temperature = 0;
+  int8_t dht_status;
+
+  // full 8MHz clock, fuse divides it by 8 after reset
+  clock_prescale_set(clock_div_1);
+
+  // WDT is used only as wakeup source - make sure it does not reset MCU
+  wdt_stop();
+
+  // initialize 9600 baud 8N1 RS232 and 1 ms system tick
+  init_uart();
+  init_tick();
+
+  // DHT data line idle HIGH
+  dht_init();
+
+  // try to communicate with SIM800L over AT until SIM800L has started up, CHECKAT_ATTEMPTS at most
+  checkat();
+
+   // Fix UART speed to 9600 bps to disable autosensing
+  at_command(SET9600, AT_TIMEOUT_CMD); 
+
+   // Turn off blinking LED on SIM800L module to conserve energy
+  at_command(DISABLELED, AT_TIMEOUT_CMD); 
+
+   // Set SIM800L clock from the network when it registers
+  at_command(CLOCKSYNC, AT_TIMEOUT_CMD);
+
+   // Save settings to SIM800L
+  at_command(SAVECNF, AT_TIMEOUT_CMD);
+
+   // check pin status, registration status and provision APN settings
+  checkpin();
+  // disable airplane mode - turn on radio and start to search for networks 
+  at_command(FLIGHTOFF, AT_TIMEOUT_CFUN);   
+  checkregistration();
   
-                 do { 
-                     // first check if network is available
-                     checkregistration();
-                     delay_sec(1);   
-                     //and close the bearer first maybe there was an error or something
-                     uart_puts_P(SAPBRCLOSE);
-                     // connection to GPRS for AGPS basestation data - provision APN and username
-                     delay_sec(5);
-                     uart_puts_P(SAPBR1);
-                     delay_sec(1);
-                     uart_puts_P(SAPBR2);
-                     // only if username password in APN is needed
-                     delay_sec(1);
-                     uart_puts_P(SAPBR3);
-                     delay_sec(1);
-                     uart_puts_P(SAPBR4);
-            
-                     // make GPRS network attach and open IP bearer
-                      delay_sec(3);
-                      uart_puts_P(SAPBROPEN);
-
-                      // query PDP context for IP address after several seconds
-                     // check if GPRS attach was succesfull, do it several times if needed
-                      initialized = 0; 
-                      delay_sec(5);
-                      uart_puts_P(SAPBRQUERY);
-                      if (readline()>0)
-                            {
-                              // checking for properly attached
-                              memcpy_P(buf, SAPBRSUCC, sizeof(SAPBRSUCC));                     
-                              if (is_in_rx_buffer(response, buf) == 1)  initialized = 1;
-                              // other responses simply ignored as there was no attach
-                            };
-                       // increase attempt counter and repeat until not attached
-                      attempt++;
-                 } while ( (attempt < 3) && (initialized == 0) );
-           
-
-               // initialize DHT22 temperature & humidity sensor, we will get reading after 4 seconds
-               dht_init();
-
-               // initialize HTTP communication on SIM800L
-               delay_sec(5);
-               uart_puts_P(HTTPINIT);
-               delay_sec(3);
-               uart_puts_P(HTTPPARA);
-               delay_sec(2);
-
-               // begin sending to Thingspeak server 
-               uart_puts_P(HTTPTSPK1);
-               uart_puts_P(HTTPTSPK2);
-               uart_puts_P(HTTPAPIKEY);
-          
-               // Now Read data from DHT22 sensor
-               // read value from DHT22 sensor, humidity amd temperature are encoded on 16 bits each
-               dht_read(&temperature_hi, &temperature_lo,  &humidity_hi, &humidity_lo);
-               // Reading correction - check if most significant bit 15 is 1 from DHT 22 temperature reading
-               // if so - temperature is below zero Celsius Degrees
-               if (temperature_hi > 127)  
-                    { // put 'minus' sign at the end instead of degrees, and clear first significant bit of temperature
-                      temperature_hi = temperature_hi - 128;
-                      belowzero = 45;  // MINUS character
-                    } 
-               else  
-                    {
-                      // do not change temperature reading, put 'zero' instead of minus sign
-                      belowzero = 48;  // ZERO character
-                    };
-
-               // calculate 16bit temperature ( 10 times real temperature value)   
-               temperature = ( temperature_hi * 256 ) + temperature_lo;
-               // calculate 16bit Humidity ( 10 times real humidity value)   
-               humidity = ( humidity_hi * 256 ) + humidity_lo;
-
-               // send details about sensor status
-
-              // calculate 3 digits for temperature
-              uart_puts_P(HTTPTSPK3);  // put 'field1' in HTTP req
-              dhttxt[0] = belowzero;
-              dhttxt[1] = (temperature / 100) + 48;  // calculate ASCII code for digits
-              temporary = temperature % 100; 
-              dhttxt[2] = (temporary / 10) + 48;
-              dhttxt[3] = 46 ;  // the DOT character
-              dhttxt[4] = (temporary % 10) + 48; 
-              uart_puts(dhttxt);   // send DHT22 temperature readings
-
-              // calculate 3 digits for humidity
-              uart_puts_P(HTTPTSPK4);  // put 'field2' in HTTP req
-              dhttxt[0] = 48;  // empty 'zero'
-              dhttxt[1] = (humidity / 100) + 48;
-              temporary = humidity % 100; 
-              dhttxt[2] = (temporary / 10) + 48;
-              dhttxt[3] = 46 ;   // the DOT character
-              dhttxt[4] = (temporary % 10) + 48; 
-              uart_puts(dhttxt);   // send DHT22 humidity readings
-
-              // send HTTP end sequence and make HTTP action
-              uart_puts_P(HTTPTSPK5);  // put CRLF at the end
-              delay_sec(2); 
-              uart_puts_P(HTTPACTION);  // send prepared HTTP POST
-              delay_sec(10);            // more seconds needed for stable TCP connection
- 
-              //and close the bearer 
-              uart_puts_P(SAPBRCLOSE);
-              delay_sec(5);
-              // disable radio before SIM800L goes to sleep 
-              //uart_puts_P(FLIGHTON);   
-              //delay_sec(2);
-              // enter SLEEP MODE of SIM800L before nex measurement to conserve energy
-              uart_puts_P(SLEEPON); 
-              delay_sec(11);
-              // sleep 'N' minutes  before next measurement and GPRS connection.  
-               for (attempt=1; attempt<120; attempt++)  delay_sec(60);
-              // disable SLEEPMODE , turn on radio and start whole procedure again...                
-              uart_puts_P(AT);
-              delay_sec(1);
-              uart_puts_P(SLEEPOFF);
+
+  // restore EEPROM log position
+  log_init();
+
+  // first sample and upload right now, next samples every SAMPLE_INTERVAL
+  next_sample = millis();
+  next_upload = next_sample;
+
+  // neverending LOOP
+
+       while (1) {
+
+                sample_due = ( (int32_t)(next_sample - millis()) <= 0 );
+                upload_due = ( (int32_t)(next_upload - millis()) <= 0 );
+
+                // store new sample to EEPROM log, upload is needed when it left the dead band
+                if (sample_due)
+                   {
+                     dht_start();
+                     dht_status = dht_wait(&temperature_hi, &temperature_lo,  &humidity_hi, &humidity_lo);
+                     // calculate 16bit Humidity ( 10 times real humidity value)   
+                     humidity = ( humidity_hi * 256 ) + humidity_lo;
+                     // calculate 16bit temperature ( 10 times real temperature value), most significant bit 15
+                     // of DHT 22 temperature reading is 1 when temperature is below zero Celsius Degrees
+                     temperature = ( (temperature_hi & 0x7F) * 256 ) + temperature_lo;
+                     if (temperature_hi > 127)  temperature = -temperature;
+                     // failed reading is logged as gap ( zeros would look like a change and start an upload )
+                     // and does not change alarm state
+                     if (dht_status != DHT_ERR_OK)  log_gap();
+                     else
+                        {
+                          log_append(temperature, humidity);
+                          if ( (upload_hold == 0) && log_changed() )  upload_due = 1;
+                          // alarm raised or cleared is uploaded right away
+                          if ( alarm_check(ALARM_TEMPERATURE, temperature, TEMPERATURE_LOW, TEMPERATURE_HIGH, TEMPERATURE_HYST) |
+                               alarm_check(ALARM_HUMIDITY, (int16_t)humidity, HUMIDITY_LOW, HUMIDITY_HIGH, HUMIDITY_HYST) )
+                               upload_due = 1;
+                        };
+                     // sample periods missed during long upload are gaps too
+                     next_sample += SAMPLE_INTERVAL;
+                     while ( (int32_t)(next_sample - millis()) <= 0 )
+                        { log_gap();
+                          next_sample += SAMPLE_INTERVAL;
+                        };
+                   };
+
+                if (upload_due)
+                   {
+                     // disable SLEEPMODE and reuse GPRS session from previous upload if it is still up,
+                     // dead SIM800L or unusable SIM card leaves the radio off until next session, so does
+                     // backoff after unsuccessful network search
+                     initialized = 0;
+                     if ( (modemwakeup() == AT_OK) && checkpin() )
+                        {
+                          if (reg_backoff() == 0)
+                             {
+                               at_command(FLIGHTOFF, AT_TIMEOUT_CFUN);
+#if UPLINK == UPLINK_HTTP
+                               initialized = bearer_up();
+#else
+                               initialized = cip_up();
+#endif
+                             };
+                        }
+                     else  at_command(FLIGHTON, AT_TIMEOUT_CFUN);
+                   };
+
+                // send all samples waiting for upload, one HTTP POST for every HTTP_UPLOAD_MAX of them
+                // or MQTT message / frame for every UPLOAD_MAX,
+                // nothing is sent when there is no IP connection - samples stay in EEPROM for next session
+                if (upload_due)
+                   {
+                     if (initialized == 1)
+                        while (log_pending() > 0)
+                           if (upload() != AT_OK) break;
+                     // IP connection and HTTP service stay open, enter SLEEP MODE of SIM800L before next upload to conserve energy
+                     at_command(SLEEPON, AT_TIMEOUT_CMD); 
+                     // heartbeat after successful upload, retry after failed one
+                     next_upload = log_delivered();
+                   };
+
+                // sleep in POWER DOWN mode until next sample or upload, whichever comes first
+                if ( (int32_t)(next_upload - next_sample) < 0 )  sleep_until(next_upload);
+                else  sleep_until(next_sample);
 
         // end of neverending loop
         };
@@ -650,4 +2498,3 @@ int main(void) {
  
     // end of MAIN code 
 }
-